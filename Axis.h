@@ -0,0 +1,165 @@
+#ifndef AXIS_H_
+#define AXIS_H_
+
+// Stepper axes as types. Axis<AxisPins<...>, AxisConfig<...> > has only static members and its pins
+// and settings are template arguments, so the compiler turns every access into a store of a constant
+// to a GPIO register, and drops the code for pins that are NC and for settings that are off.
+// AxisList<> strings the axes together for the code that handles all of them: axis n of the list has
+// bit 1 << n in the masks of axes (X_AXIS_BIT...) and entry n in axis_state[], the stepper's state of
+// all axes in one array. The recursion over the list unrolls at compile time.
+//
+// Another axis, e.g. a second extruder, is one more AxisList<> entry in main.cpp with its pins from
+// pins.h, stepper_isr() picks it up from there.
+
+// Pins as GPIO port and bit. mbed numbers the pins from P0_0 = LPC_GPIO0_BASE up, 32 per port,
+// so for the pins from pins.h all of this folds into constants.
+#define PIN_PORT(pin) (((unsigned long)(pin) - LPC_GPIO0_BASE) >> 5)
+#define PIN_MASK(pin) (1UL << (((unsigned long)(pin) - LPC_GPIO0_BASE) & 31))
+#define ADD_PIN(masks, pin) if ((pin) != NC) masks[PIN_PORT(pin)] |= PIN_MASK(pin)
+#define GPIO_PORTS 5
+
+LPC_GPIO_TypeDef *const gpio_port[GPIO_PORTS] = {LPC_GPIO0, LPC_GPIO1, LPC_GPIO2, LPC_GPIO3, LPC_GPIO4};
+
+// The mbed objects only set the pins up (GPIO function, direction), the stepper writes the registers
+inline void gpio_output(long pin) {
+    if (pin != NC) DigitalOut((PinName)pin);
+}
+
+inline void gpio_input(long pin) {
+    if (pin != NC) DigitalIn((PinName)pin);
+}
+
+inline void gpio_write(long pin, bool high) {
+    if (pin == NC) return;
+    if (high) gpio_port[PIN_PORT(pin)]->FIOSET = PIN_MASK(pin);
+    else gpio_port[PIN_PORT(pin)]->FIOCLR = PIN_MASK(pin);
+}
+
+inline bool gpio_read(long pin) {
+    return (gpio_port[PIN_PORT(pin)]->FIOPIN & PIN_MASK(pin)) != 0;
+}
+
+// NC for the pins an axis doesn't have, the LED shows that the axis is moving
+template <PinName STEP, PinName DIR, PinName ENABLE, PinName MIN = NC, PinName LED = NC>
+struct AxisPins {
+    static const PinName step = STEP, dir = DIR, enable = ENABLE, min = MIN, led = LED;
+};
+
+template <bool INVERT_DIR, bool ENABLE_ON, bool DISABLE_AFTER_MOVE>
+struct AxisConfig {
+    enum { invert_dir = INVERT_DIR, enable_on = ENABLE_ON, disable_after_move = DISABLE_AFTER_MOVE };
+};
+
+template <class Pins, class Config>
+struct Axis {
+    enum {
+        invert_dir = Config::invert_dir,
+        disable_after_move = Config::disable_after_move,
+        has_min_endstop = (Pins::min != NC)
+    };
+
+    static void init() {
+        gpio_output(Pins::step);
+        gpio_output(Pins::dir);
+        gpio_output(Pins::enable);
+        gpio_output(Pins::led);
+        gpio_input(Pins::min);
+    }
+    static void enable() { gpio_write(Pins::enable, Config::enable_on); }
+    static void disable() {
+        gpio_write(Pins::enable, !Config::enable_on);
+        gpio_write(Pins::led, false);
+    }
+    static void show_moving(bool moving) { gpio_write(Pins::led, moving); }
+    static bool dir_high(bool forward) { return forward != (bool)Config::invert_dir; }
+    static void set_direction(bool forward) { gpio_write(Pins::dir, dir_high(forward)); }
+    static bool min_endstop_hit() { return has_min_endstop && gpio_read(Pins::min) != ENDSTOPS_INVERTING; }
+    static void add_step_pin(unsigned long masks[]) { ADD_PIN(masks, Pins::step); }
+    static void add_dir_pin(unsigned long masks[]) { ADD_PIN(masks, Pins::dir); }
+};
+
+// State of an axis in stepper_isr(), the axes are next to each other in axis_state[]
+typedef struct {
+    int steps; // steps of the current block
+    int steps_remaining;
+    int counter; // Bresenham counter
+    int steps_skipped; // steps of the current or last block the min endstop left out
+    bool forward; // direction of the current block
+} axis_state_t;
+
+struct AxisListEnd {
+    enum { count = 0, inverted_dirs = 0, disabled_after_move = 0, has_min_endstops = 0 };
+    static void init() {}
+    static void enable(int) {}
+    static void disable(int) {}
+    static void show_moving(int) {}
+    static void add_step_pins(unsigned long *, int) {}
+    static void add_dir_pins(unsigned long *, unsigned long *, int, int) {}
+    static void stop_at_min_endstops(axis_state_t *) {}
+    static int bresenham(axis_state_t *, int) { return 0; }
+    static bool steps_left(const axis_state_t *) { return false; }
+};
+
+template <class A, class Next = AxisListEnd>
+struct AxisList {
+    enum {
+        count = 1 + Next::count,
+        inverted_dirs = (A::invert_dir ? 1 : 0) | (Next::inverted_dirs << 1),
+        disabled_after_move = (A::disable_after_move ? 1 : 0) | (Next::disabled_after_move << 1),
+        has_min_endstops = A::has_min_endstop || Next::has_min_endstops
+    };
+
+    static void init() {
+        A::init();
+        Next::init();
+    }
+    // The axes in axes, bit 0 is the first one of the list
+    static void enable(int axes) {
+        if (axes & 1) A::enable();
+        Next::enable(axes >> 1);
+    }
+    static void disable(int axes) {
+        if (axes & 1) A::disable();
+        Next::disable(axes >> 1);
+    }
+    static void show_moving(int axes) {
+        A::show_moving(axes & 1);
+        Next::show_moving(axes >> 1);
+    }
+    static void add_step_pins(unsigned long masks[], int axes) {
+        if (axes & 1) A::add_step_pin(masks);
+        Next::add_step_pins(masks, axes >> 1);
+    }
+    // Direction pins of axes, high ones into set and low ones into clear
+    static void add_dir_pins(unsigned long set[], unsigned long clear[], int high, int axes) {
+        if (axes & high & 1) A::add_dir_pin(set);
+        else if (axes & 1) A::add_dir_pin(clear);
+        Next::add_dir_pins(set, clear, high >> 1, axes >> 1);
+    }
+    // No more steps towards an endstop that has been hit
+    static void stop_at_min_endstops(axis_state_t *state) {
+        if (A::has_min_endstop && !state->forward && state->steps_remaining && A::min_endstop_hit()) {
+            state->steps_skipped = state->steps_remaining;
+            state->steps_remaining = 0;
+        }
+        Next::stop_at_min_endstops(state + 1);
+    }
+    // One step event of the current block, returns the axes that step
+    static int bresenham(axis_state_t *state, int step_event_count) {
+        int axes = 0;
+        state->counter += state->steps;
+        if (state->counter > 0) {
+            state->counter -= step_event_count;
+            if (state->steps_remaining > 0) {
+                state->steps_remaining--;
+                axes = 1;
+            }
+        }
+        return axes | (Next::bresenham(state + 1, step_event_count) << 1);
+    }
+    static bool steps_left(const axis_state_t *state) {
+        return state->steps_remaining || Next::steps_left(state + 1);
+    }
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef BEDMESH_H_
+#define BEDMESH_H_
+
+// Mesh bed leveling. G29 probes the height of the bed on a grid of MESH_POINTS_X x MESH_POINTS_Y points
+// with the Z min endstop, mesh_z holds the heights relative to the first point. Between the points the
+// bed is interpolated bilinearly, outside the grid the edge cells continue. The correction is added to
+// the Z target of every move and fades out linearly up to mesh_fade_height, above that the moves are
+// planned as without a mesh. The mesh is kept in MESH_FILE and read back at startup.
+//
+// mesh_move() in main.cpp splits the moves where they cross the grid lines. A move crosses the lines
+// of a column at fixed steps of its fraction, and the height at a crossing only needs the two points
+// of that grid line, see mesh_column_z() and mesh_row_z().
+
+#define MESH_FILE FILE_SYSTEM_ROOT "/mesh.txt"
+
+float mesh_z[MESH_POINTS_Y][MESH_POINTS_X]; // mm, [y][x]
+bool mesh_valid = false; // mesh_z has been probed or read
+bool mesh_enabled = false; // moves are corrected, see M420
+
+float mesh_spacing_x() {
+    return (mesh_max_x - mesh_min_x)/(MESH_POINTS_X - 1);
+}
+
+float mesh_spacing_y() {
+    return (mesh_max_y - mesh_min_y)/(MESH_POINTS_Y - 1);
+}
+
+float mesh_point_x(int ix) {
+    return mesh_min_x + ix*mesh_spacing_x();
+}
+
+float mesh_point_y(int iy) {
+    return mesh_min_y + iy*mesh_spacing_y();
+}
+
+// Cell of a coordinate, the left or front point of it. Outside the grid the edge cell.
+int mesh_cell_x(float x) {
+    int ix = (int)floor((x - mesh_min_x)/mesh_spacing_x());
+    if (ix < 0) return 0;
+    if (ix > MESH_POINTS_X - 2) return MESH_POINTS_X - 2;
+    return ix;
+}
+
+int mesh_cell_y(float y) {
+    int iy = (int)floor((y - mesh_min_y)/mesh_spacing_y());
+    if (iy < 0) return 0;
+    if (iy > MESH_POINTS_Y - 2) return MESH_POINTS_Y - 2;
+    return iy;
+}
+
+// Position of distance inside a cell of size spacing, 0 to 1
+float mesh_fraction(float distance, float spacing) {
+    float fraction = distance/spacing;
+    if (fraction < 0) return 0;
+    if (fraction > 1) return 1;
+    return fraction;
+}
+
+// Height of the bed on the grid line through the points of column ix, at y
+float mesh_column_z(int ix, float y) {
+    int iy = mesh_cell_y(y);
+    float fraction = mesh_fraction(y - mesh_point_y(iy), mesh_spacing_y());
+    return mesh_z[iy][ix] + (mesh_z[iy + 1][ix] - mesh_z[iy][ix])*fraction;
+}
+
+// Height of the bed on the grid line through the points of row iy, at x
+float mesh_row_z(int iy, float x) {
+    int ix = mesh_cell_x(x);
+    float fraction = mesh_fraction(x - mesh_point_x(ix), mesh_spacing_x());
+    return mesh_z[iy][ix] + (mesh_z[iy][ix + 1] - mesh_z[iy][ix])*fraction;
+}
+
+// Height of the bed at x, y
+float mesh_z_at(float x, float y) {
+    int ix = mesh_cell_x(x);
+    float fraction = mesh_fraction(x - mesh_point_x(ix), mesh_spacing_x());
+    float z = mesh_column_z(ix, y);
+    return z + (mesh_column_z(ix + 1, y) - z)*fraction;
+}
+
+// Part of the correction that is left at height z, 1 at the bed and 0 from mesh_fade_height up
+float mesh_fade(float z) {
+    if (!mesh_enabled) return 0;
+    if (mesh_fade_height <= 0 || z <= 0) return 1;
+    if (z >= mesh_fade_height) return 0;
+    return 1 - z/mesh_fade_height;
+}
+
+// What the mesh adds to the Z target of a move to x, y, z
+float mesh_correction(float x, float y, float z) {
+    float fade = mesh_fade(z);
+    return fade ? mesh_z_at(x, y)*fade : 0;
+}
+
+// The Z coordinate at x, y that the correction takes to height, the inverse of z + mesh_correction()
+float mesh_z_for_height(float x, float y, float height) {
+    if (!mesh_enabled) return height;
+    float z = mesh_z_at(x, y);
+    if (mesh_fade_height <= 0 || height <= z) return height - z;
+    if (height >= mesh_fade_height) return height;
+    return (height - z)/(1 - z/mesh_fade_height);
+}
+
+// The grid and the heights as text, the grid has to be the same when the mesh is read back
+bool mesh_save() {
+    FILE *file = fopen(MESH_FILE, "w");
+    if (!file) return false;
+    fprintf(file, "%d %d %f %f %f %f\n", MESH_POINTS_X, MESH_POINTS_Y, mesh_min_x, mesh_max_x, mesh_min_y, mesh_max_y);
+    for (int iy = 0; iy < MESH_POINTS_Y; iy++) {
+        for (int ix = 0; ix < MESH_POINTS_X; ix++) {
+            fprintf(file, ix ? " %f" : "%f", mesh_z[iy][ix]);
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+    return true;
+}
+
+// Read the mesh of the last G29 and turn the correction on, returns false if there is none for this grid
+bool mesh_load() {
+    FILE *file = fopen(MESH_FILE, "r");
+    if (!file) return false;
+    int points_x, points_y;
+    float min_x, max_x, min_y, max_y;
+    bool ok = fscanf(file, "%d %d %f %f %f %f", &points_x, &points_y, &min_x, &max_x, &min_y, &max_y) == 6
+        && points_x == MESH_POINTS_X && points_y == MESH_POINTS_Y
+        && fabs(min_x - mesh_min_x) < 0.001 && fabs(max_x - mesh_max_x) < 0.001
+        && fabs(min_y - mesh_min_y) < 0.001 && fabs(max_y - mesh_max_y) < 0.001;
+    for (int iy = 0; ok && iy < MESH_POINTS_Y; iy++) {
+        for (int ix = 0; ok && ix < MESH_POINTS_X; ix++) {
+            ok = fscanf(file, "%f", &mesh_z[iy][ix]) == 1;
+        }
+    }
+    fclose(file);
+    mesh_valid = mesh_enabled = ok;
+    return ok;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef BINARYPROTOCOL_H_
+#define BINARYPROTOCOL_H_
+
+// Binary command packets, sent instead of ASCII lines after M860 S1 (M860 S0 switches back).
+// A packet carries the same words as a G-code line, all values little endian:
+//
+//   byte 0      BINARY_SYNC
+//   byte 1..2   sequence number, takes the place of N
+//   byte 3      command letter ('G', 'M', 'T') or 0 if the line has none
+//   byte 4..5   command number
+//   byte 6..9   field mask, bit n set if letter 'A'+n follows
+//   4 bytes per field, a float, in letter order
+//   2 bytes     CRC-16 (CCITT, polynomial 0x1021, start 0xFFFF) over byte 1 up to the last field
+//
+// "G1 X102.345 Y87.21 E12.3456 F1800" is 28 bytes instead of 43 as an ASCII line with N and checksum.
+// tools/gcode2bin.py converts G-code files to packets on the host.
+
+#define BINARY_SYNC 0xA5
+#define BINARY_HEADER_SIZE 10
+#define BINARY_FIELD_SIZE 4
+#define BINARY_CRC_SIZE 2
+#define BINARY_MAX_PACKET_SIZE (BINARY_HEADER_SIZE + 26*BINARY_FIELD_SIZE + BINARY_CRC_SIZE)
+
+// crc continues the CRC of the bytes in front of data, if they weren't all in one piece
+unsigned short crc16(const unsigned char *data, int length, unsigned short crc = 0xFFFF) {
+    while (length--) {
+        crc ^= (unsigned short)(*data++) << 8;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+unsigned short binary_get_u16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+unsigned long binary_get_u32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+float binary_get_float(const unsigned char *p) {
+    union { unsigned long u; float f; } value;
+    value.u = binary_get_u32(p);
+    return value.f;
+}
+
+void binary_put_u16(unsigned char *p, unsigned short value) {
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+void binary_put_u32(unsigned char *p, unsigned long value) {
+    binary_put_u16(p, value);
+    binary_put_u16(p + 2, value >> 16);
+}
+
+void binary_put_float(unsigned char *p, float f) {
+    union { unsigned long u; float f; } value;
+    value.f = f;
+    binary_put_u32(p, value.u);
+}
+
+int binary_field_count(unsigned long mask) {
+    int count = 0;
+    for (; mask; mask &= mask - 1) count++;
+    return count;
+}
+
+// Size of a whole packet, once its first BINARY_HEADER_SIZE bytes are known
+int binary_packet_size(const unsigned char *packet) {
+    return BINARY_HEADER_SIZE + binary_field_count(binary_get_u32(packet + 6) & 0x3FFFFFF)*BINARY_FIELD_SIZE + BINARY_CRC_SIZE;
+}
+
+bool binary_crc_ok(const unsigned char *packet) {
+    int size = binary_packet_size(packet);
+    return crc16(packet + 1, size - 1 - BINARY_CRC_SIZE) == binary_get_u16(packet + size - BINARY_CRC_SIZE);
+}
+
+// Build a packet in buffer (at least BINARY_MAX_PACKET_SIZE bytes), value is indexed by letter like mask.
+// Returns the packet size.
+int binary_encode(unsigned char *buffer, unsigned short sequence, char letter, unsigned short number, unsigned long mask, const float *value) {
+    unsigned char *p = buffer + BINARY_HEADER_SIZE;
+    mask &= 0x3FFFFFF;
+    buffer[0] = BINARY_SYNC;
+    binary_put_u16(buffer + 1, sequence);
+    buffer[3] = letter;
+    binary_put_u16(buffer + 4, number);
+    binary_put_u32(buffer + 6, mask);
+    for (int i = 0; i < 26; i++) {
+        if (mask & (1UL << i)) {
+            binary_put_float(p, value[i]);
+            p += BINARY_FIELD_SIZE;
+        }
+    }
+    binary_put_u16(p, crc16(buffer + 1, p - buffer - 1));
+    return p - buffer + BINARY_CRC_SIZE;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef EVENTTRACE_H_
+#define EVENTTRACE_H_
+
+// Event trace: a ring buffer in RAM of the last TRACE_SIZE events, each 8 bytes, little endian:
+//
+//   byte 0..3   time in us, timer 3 (the mbed us_ticker behind Timer and Ticker), wraps after 71 minutes
+//   byte 4      event type, TRACE_LINE_RECEIVED...
+//   byte 5      argument, e.g. the heater
+//   byte 6..7   data, e.g. the line number or the ADC reading
+//
+// M870 S<mask> starts recording the event types with their bit set in mask (all without S) and
+// clears the buffer, M870 S0 stops. M871 stops and sends the buffer, oldest event first:
+//
+//   "trace:<events> lost:<events overwritten> us:<time now>\n", the events, the CRC-16 of BinaryProtocol.h
+//   over the events (2 bytes), "\n"
+//
+// tools/trace2chrome.py turns the dump into a Chrome trace (chrome://tracing or ui.perfetto.dev).
+// An event type that isn't recorded costs a load and a test, a recorded one about 20 cycles, so the
+// trace can stay on while printing.
+
+#define TRACE_SIZE 1024 // events, must be a power of 2
+
+#define TRACE_LINE_RECEIVED 0 // data: line number
+#define TRACE_OK_SENT 1
+#define TRACE_MOVE_START 2 // arg: block index, data: step events of the block
+#define TRACE_MOVE_END 3 // arg: block index
+#define TRACE_STEP_ISR 4 // data: timer 2 ticks since the step was due
+#define TRACE_HEATER 5 // arg: heater, data: 1 on, 0 off
+#define TRACE_ADC 6 // arg: heater, data: thermistor sample
+
+typedef struct {
+    unsigned long time;
+    unsigned char type;
+    unsigned char arg;
+    unsigned short data;
+} trace_event_t;
+
+trace_event_t trace_buffer[TRACE_SIZE];
+volatile unsigned long trace_head = 0; // events recorded since M870, the next one goes to trace_head % TRACE_SIZE
+volatile unsigned long trace_mask = 0; // bit n set: record event type n
+
+#define TRACING(type) (trace_mask & (1UL << (type)))
+#define TRACE(type, arg, data) do { if (TRACING(type)) trace_record(type, arg, data); } while (0)
+
+// Any interrupt may record, the slot is claimed with LDREX/STREX so no interrupts need to be disabled
+void trace_record(int type, int arg, int data) {
+    unsigned long index;
+    do {
+        index = __ldrex(&trace_head);
+    } while (__strex(index + 1, &trace_head));
+
+    trace_event_t *event = &trace_buffer[index & (TRACE_SIZE - 1)];
+    event->time = LPC_TIM3->TC;
+    event->type = type;
+    event->arg = arg;
+    event->data = data;
+}
+
+void trace_start(unsigned long mask) {
+    trace_mask = 0;
+    trace_head = 0;
+    trace_mask = mask;
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef INPUTSHAPER_H_
+#define INPUTSHAPER_H_
+
+// Input shaping for X and Y. Every step of a shaped axis is split into impulses: a part of the step
+// right away and the rest later, with amplitudes and delays chosen so the ringing the first part
+// excites in the frame is cancelled by the others. The axis steps when the sum of the parts so far
+// crosses half a step, so the shaped motion is the commanded one convolved with the impulses.
+//
+//   ZV   2 impulses over half a period of the ringing, cancels it at the frequency
+//   MZV  3 impulses over 3/4 of a period, also works a bit off the frequency
+//   EI   3 impulses over a whole period, keeps the ringing below 5% over a wide band
+//
+// The step events waiting for their later impulses are kept in shaper_queue, 4 bytes each. The
+// planner limits the step rate so that the queue can hold all step events of the longest delay.
+// Amplitudes are 16.16 fixed point, delays and times are in step timer ticks, the times in the queue
+// are the low 24 bits (0.7 s at 24 MHz, far more than the longest delay).
+
+#define SHAPER_NONE 0
+#define SHAPER_ZV 1
+#define SHAPER_MZV 2
+#define SHAPER_EI 3
+
+#define SHAPER_MAX_IMPULSES 3
+#define SHAPER_QUEUE_SIZE 1024 // step events, must be a power of 2
+#define SHAPER_ONE 65536L // a whole step
+#define SHAPER_TIME_MASK 0xFFFFFFUL
+#define SHAPER_EI_TOLERANCE 0.05 // residual vibration EI allows
+#define SHAPER_MIN_FREQUENCY 5.0 // Hz, M593 limits, so the longest delay stays far below the 24 bit times
+#define SHAPER_MAX_DAMPING 0.5
+
+typedef struct {
+    int impulses; // 1 = not shaped
+    long amplitude[SHAPER_MAX_IMPULSES]; // part of a step, sum SHAPER_ONE
+    unsigned long delay[SHAPER_MAX_IMPULSES]; // ticks, delay[0] = 0
+    unsigned int echo[SHAPER_MAX_IMPULSES]; // queue index of the next step event for impulse i >= 1
+    long error; // shaped position - position of the motor, 1/SHAPER_ONE steps
+} shaper_axis_t;
+
+shaper_axis_t shaper_axis[2]; // X, Y
+unsigned long shaper_queue[SHAPER_QUEUE_SIZE]; // time | flags << 24
+unsigned int shaper_queue_head = 0; // next free entry
+
+// Flags of a queued step event, 2 bits per axis
+#define SHAPER_STEP(axis) (1UL << (24 + 2*(axis)))
+#define SHAPER_BACKWARDS(axis) (1UL << (25 + 2*(axis)))
+
+// Impulses of a shaper for ringing at frequency (Hz) with damping ratio damping
+void shaper_configure(shaper_axis_t *shaper, int type, float frequency, float damping, float ticks_per_second) {
+    float amplitude[SHAPER_MAX_IMPULSES] = {1, 0, 0};
+    float delay[SHAPER_MAX_IMPULSES] = {0, 0, 0}; // in periods of the damped ringing
+    int impulses = 1;
+    float pi = 3.14159265;
+    float root = sqrt(1 - damping*damping);
+    float k = exp(-damping*pi/root);
+
+    if (type == SHAPER_ZV) {
+        impulses = 2;
+        amplitude[1] = k;
+        delay[1] = 0.5;
+    } else if (type == SHAPER_MZV) {
+        k = exp(-0.75*damping*pi/root);
+        impulses = 3;
+        amplitude[0] = 1 - 1/sqrt(2.0);
+        amplitude[1] = (sqrt(2.0) - 1)*k;
+        amplitude[2] = amplitude[0]*k*k;
+        delay[1] = 0.375;
+        delay[2] = 0.75;
+    } else if (type == SHAPER_EI) {
+        impulses = 3;
+        amplitude[0] = 0.25*(1 + SHAPER_EI_TOLERANCE);
+        amplitude[1] = 0.5*(1 - SHAPER_EI_TOLERANCE)*k;
+        amplitude[2] = amplitude[0]*k*k;
+        delay[1] = 0.5;
+        delay[2] = 1;
+    }
+
+    float sum = 0;
+    for (int i = 0; i < impulses; i++) sum += amplitude[i];
+    long total = 0;
+    shaper->impulses = impulses;
+    for (int i = 0; i < impulses; i++) {
+        shaper->amplitude[i] = (i == impulses - 1) ? SHAPER_ONE - total : (long)(amplitude[i]/sum*SHAPER_ONE + 0.5);
+        total += shaper->amplitude[i];
+        shaper->delay[i] = delay[i]*ticks_per_second/(frequency*root);
+        shaper->echo[i] = shaper_queue_head;
+    }
+    shaper->error = 0;
+}
+
+unsigned long shaper_longest_delay() {
+    unsigned long longest = 0;
+    for (int axis = 0; axis < 2; axis++) {
+        unsigned long delay = shaper_axis[axis].delay[shaper_axis[axis].impulses - 1];
+        if (delay > longest) longest = delay;
+    }
+    return longest;
+}
+
+// Entries still waiting for a later impulse of some axis
+unsigned int shaper_queue_used() {
+    unsigned int used = 0;
+    for (int axis = 0; axis < 2; axis++) {
+        for (int i = 1; i < shaper_axis[axis].impulses; i++) {
+            unsigned int waiting = (shaper_queue_head - shaper_axis[axis].echo[i]) & (SHAPER_QUEUE_SIZE - 1);
+            if (waiting > used) used = waiting;
+        }
+    }
+    return used;
+}
+
+// A step event at time: the first impulse of each step right away, the step event waits in the queue
+// for the others. flags has SHAPER_STEP and SHAPER_BACKWARDS of the axes that step.
+void shaper_add_step_event(unsigned long time, unsigned long flags) {
+    for (int axis = 0; axis < 2; axis++) {
+        if (flags & SHAPER_STEP(axis)) {
+            shaper_axis_t *shaper = &shaper_axis[axis];
+            shaper->error += (flags & SHAPER_BACKWARDS(axis)) ? -shaper->amplitude[0] : shaper->amplitude[0];
+        }
+    }
+    if (shaper_axis[0].impulses > 1 || shaper_axis[1].impulses > 1) {
+        shaper_queue[shaper_queue_head] = (time & SHAPER_TIME_MASK) | flags;
+        shaper_queue_head = (shaper_queue_head + 1) & (SHAPER_QUEUE_SIZE - 1);
+    }
+}
+
+// Ticks from now until impulse i of the queued step event is due, 0 if it is due already
+unsigned long shaper_due_in(unsigned long entry, unsigned long delay, unsigned long now) {
+    unsigned long ticks = ((entry & SHAPER_TIME_MASK) + delay - now) & SHAPER_TIME_MASK;
+    return (ticks & 0x800000UL) ? 0 : ticks;
+}
+
+// Add the impulses that are due at now. Returns the ticks until the next one is due, 0 if none is queued.
+unsigned long shaper_update(unsigned long now) {
+    unsigned long next = 0;
+    for (int axis = 0; axis < 2; axis++) {
+        shaper_axis_t *shaper = &shaper_axis[axis];
+        for (int i = 1; i < shaper->impulses; i++) {
+            while (shaper->echo[i] != shaper_queue_head) {
+                unsigned long entry = shaper_queue[shaper->echo[i]];
+                if (entry & SHAPER_STEP(axis)) {
+                    unsigned long ticks = shaper_due_in(entry, shaper->delay[i], now);
+                    if (ticks) {
+                        if (!next || ticks < next) next = ticks;
+                        break;
+                    }
+                    shaper->error += (entry & SHAPER_BACKWARDS(axis)) ? -shaper->amplitude[i] : shaper->amplitude[i];
+                }
+                shaper->echo[i] = (shaper->echo[i] + 1) & (SHAPER_QUEUE_SIZE - 1);
+            }
+        }
+    }
+    return next;
+}
+
+// The step the motor of axis takes to follow the shaped position: 1, -1 backwards or 0. Impulses
+// that fall together can put it more than a step behind, then shaper_behind() is still true.
+int shaper_step(int axis) {
+    shaper_axis_t *shaper = &shaper_axis[axis];
+    if (shaper->error >= SHAPER_ONE/2) {
+        shaper->error -= SHAPER_ONE;
+        return 1;
+    }
+    if (shaper->error < -SHAPER_ONE/2) {
+        shaper->error += SHAPER_ONE;
+        return -1;
+    }
+    return 0;
+}
+
+bool shaper_behind(int axis) {
+    return shaper_axis[axis].error >= SHAPER_ONE/2 || shaper_axis[axis].error < -SHAPER_ONE/2;
+}
+
+#endif
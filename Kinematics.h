@@ -0,0 +1,77 @@
+#ifndef KINEMATICS_H_
+#define KINEMATICS_H_
+
+// How the X, Y and Z motors move the nozzle. KINEMATICS in configuration.h picks one of the
+// specializations of Kinematics<> at compile time, main.cpp uses it as machine:
+//
+//   machine::motor_steps(x, y, z, steps)   motor positions in steps for a Cartesian position in mm
+//   machine::cartesian                     the motors are the X, Y and Z axes, the planner can take the
+//                                          length of a move from its steps
+//   machine::segmented                     straight lines aren't straight for the motors, prepare_move()
+//                                          splits moves into delta_segments_per_second segments
+//   machine::update()                      recompute the constants after a setting changed
+//
+// The members are static and inline, with Cartesian kinematics plan_buffer_line() compiles to the
+// same code as without this header. E is never part of the kinematics.
+
+#define KINEMATICS_CARTESIAN 0
+#define KINEMATICS_COREXY 1 // motor X moves X+Y, motor Y moves X-Y
+#define KINEMATICS_DELTA 2 // three towers, the motors move the carriages, see delta_diagonal_rod
+
+long units_to_steps(float units, float steps_per_unit);
+
+template <int type> struct Kinematics;
+
+template <> struct Kinematics<KINEMATICS_CARTESIAN> {
+    enum { cartesian = 1, segmented = 0 };
+    static void update() {}
+    static void motor_steps(float x, float y, float z, long steps[3]) {
+        steps[0] = units_to_steps(x, x_steps_per_unit);
+        steps[1] = units_to_steps(y, y_steps_per_unit);
+        steps[2] = units_to_steps(z, z_steps_per_unit);
+    }
+};
+
+// The belts of both motors move the X carriage, in the same direction for X and in opposite
+// directions for Y. x_steps_per_unit and y_steps_per_unit are those of the motors along their belts.
+template <> struct Kinematics<KINEMATICS_COREXY> {
+    enum { cartesian = 0, segmented = 0 };
+    static void update() {}
+    static void motor_steps(float x, float y, float z, long steps[3]) {
+        steps[0] = units_to_steps(x + y, x_steps_per_unit);
+        steps[1] = units_to_steps(x - y, y_steps_per_unit);
+        steps[2] = units_to_steps(z, z_steps_per_unit);
+    }
+};
+
+// Towers at 210, 330 and 90 degrees (front left, front right, back) on a circle of delta_radius
+// around the center, motors X, Y and Z move their carriages. A carriage is as high above the nozzle
+// as a rod of delta_diagonal_rod reaches over the horizontal distance to its tower, positions out of
+// reach are clamped to the rod lying flat. The motor positions are these carriage heights plus Z.
+float delta_tower_x[3], delta_tower_y[3];
+float delta_rod_squared;
+
+template <> struct Kinematics<KINEMATICS_DELTA> {
+    enum { cartesian = 0, segmented = 1 };
+    static void update() {
+        const float angle[3] = {210.0, 330.0, 90.0};
+        for (int i = 0; i < 3; i++) {
+            delta_tower_x[i] = delta_radius*cos(angle[i]*(3.14159265/180.0));
+            delta_tower_y[i] = delta_radius*sin(angle[i]*(3.14159265/180.0));
+        }
+        delta_rod_squared = delta_diagonal_rod*delta_diagonal_rod;
+    }
+    static float carriage(int tower, float x, float y, float z) {
+        float dx = delta_tower_x[tower] - x;
+        float dy = delta_tower_y[tower] - y;
+        float height_squared = delta_rod_squared - dx*dx - dy*dy;
+        return z + (height_squared > 0 ? sqrt(height_squared) : 0);
+    }
+    static void motor_steps(float x, float y, float z, long steps[3]) {
+        steps[0] = units_to_steps(carriage(0, x, y, z), x_steps_per_unit);
+        steps[1] = units_to_steps(carriage(1, x, y, z), y_steps_per_unit);
+        steps[2] = units_to_steps(carriage(2, x, y, z), z_steps_per_unit);
+    }
+};
+
+#endif
@@ -2,48 +2,37 @@
 #define THERMISTORTABLE_H_
 
 // Thermistor lookup table
-// calculated by hand for 100k thermistor
+// filled by build_temptable() at startup for a 100k thermistor, from the beta model:
+// 1/T = 1/T0 + ln(R/R0)/beta
 
-// r0: 100000
-// t0: 25
-// r1: 0
-// r2: 4700
-// beta: 4036
-// max adc: 65535
-#define NUMTEMPS 30
-int temptable[NUMTEMPS][2] = {
-   {1, 300},
-   {1668, 290},
-   {1926, 280},
-   {2224, 270},
-   {2582, 260},
-   {2999, 250},
-   {3515, 240},
-   {4131, 230},
-   {4885, 220},
-   {5799, 210},
-   {6891, 200},
-   {8242, 190},
-   {9850, 180},
-   {11816, 170},
-   {14160, 160},
-   {16960, 150},
-   {20257, 140},
-   {24030, 130},
-   {28200, 120},
-   {32768, 110},
-   {37534, 100},
-   {42449, 90},
-   {47067, 80},
-   {51237, 70},
-   {54812, 60},
-   {57791, 50},
-   {59638, 40},
-   {62160, 30},
-   {62557, 25},
-   {65000, 0},
-};
+#define THERMISTOR_R0 100000.0 // ohm at THERMISTOR_T0
+#define THERMISTOR_T0 25.0 // degrees C
+#define THERMISTOR_R1 0.0 // ohm, resistor in parallel with the thermistor, 0 if there is none
+#define THERMISTOR_R2 4700.0 // ohm, pull-up resistor
+#define THERMISTOR_BETA 4036.0
+#define THERMISTOR_MAX_ADC 65535
+#define THERMISTOR_MAX_TEMP 500.0 // degrees C, the beta model stops making sense for readings close to 0
+#define THERMISTOR_OPEN_RAW 65000 // readings from here up mean a broken wire, about -9 degrees C
+#define THERMISTOR_SHORT_RAW 300 // readings from here down mean a short, about 520 degrees C
 
+// Entry i is the temperature at the reading i*TEMPTABLE_STEP, so analog2temp() can index the table directly.
+// With 257 entries the interpolation error stays below 0.2 degrees C from 0 to 300 degrees C, see sim/check.cpp.
+#define NUMTEMPS 257
+#define TEMPTABLE_STEP ((THERMISTOR_MAX_ADC + 1)/(NUMTEMPS - 1))
+float temptable[NUMTEMPS];
 
+void build_temptable() {
+    for (int i = 0; i < NUMTEMPS; i++) {
+        // The ends of the range are a short and an open thermistor, stay just inside of them
+        float raw = i*TEMPTABLE_STEP;
+        if (raw < 1) raw = 1;
+        if (raw > THERMISTOR_MAX_ADC - 1) raw = THERMISTOR_MAX_ADC - 1;
 
-#endif
\ No newline at end of file
+        float r = THERMISTOR_R2*raw/(THERMISTOR_MAX_ADC - raw);
+        if (THERMISTOR_R1 > 0) r = 1.0/(1.0/r - 1.0/THERMISTOR_R1);
+        float inverse_t = 1.0/(THERMISTOR_T0 + 273.15) + log(r/THERMISTOR_R0)/THERMISTOR_BETA;
+        temptable[i] = (inverse_t > 1.0/(THERMISTOR_MAX_TEMP + 273.15)) ? 1.0/inverse_t - 273.15 : THERMISTOR_MAX_TEMP;
+    }
+}
+
+#endif
@@ -20,6 +20,83 @@ float e_steps_per_unit = 33.33*16;//volumetric //533.28
 //float e_steps_per_unit = 580.0;
 float max_feedrate = 18000.0;
 
+//Kinematics, see Kinematics.h: KINEMATICS_CARTESIAN, KINEMATICS_COREXY or KINEMATICS_DELTA
+#define KINEMATICS KINEMATICS_CARTESIAN
+//Delta geometry: length of the diagonal rods, horizontal distance from the center to the rod joints of a
+//carriage minus the one from the nozzle to the joints of the effector. Moves are split into straight
+//segments of delta_segments_per_second per second of travel. A delta also needs min_software_endstops false.
+float delta_diagonal_rod = 250.0; //mm
+float delta_radius = 124.0; //mm
+float delta_segments_per_second = 200.0;
+
+//Step pulses in ns: how long a step pin stays high (and at least as long low before the next pulse), and how long
+//a direction pin has to be stable before a step. See the timing of the stepper drivers, e.g. A4988 1000 and 200,
+//DRV8825 1900 and 650. The step timer times the edges, the CPU doesn't wait for them.
+#define STEP_PULSE_NS 2000
+#define DIRECTION_SETUP_NS 2000
+
+//Look-ahead planner
+#define BLOCK_BUFFER_SIZE 16 //Number of queued linear moves, must be a power of 2
+float acceleration = 1000.0; //mm/s^2, default acceleration of a move, can be changed with M204
+float junction_deviation = 0.05; //mm, how far a corner may deviate from the programmed path at junction speed
+
+//G2/G3 arcs are split into straight segments that stay within this distance of the arc
+float arc_tolerance = 0.01; //mm
+
+//Pressure advance: while a move speeds up the extruder pushes advance_k*(extruder speed) mm of extra filament
+//to build up the pressure in the nozzle, and takes it back while the move slows down. 0 turns it off, M900 sets it
+float advance_k = 0.0; //s
+
+//Input shaping of X and Y against ringing, see InputShaper.h. Type 0 off, 1 ZV, 2 MZV, 3 EI, the frequency
+//of the ringing (speed/distance between the ripples on a test print) and its damping ratio. M593 sets them
+int x_shaper_type = 0;
+float x_shaper_frequency = 40.0; //Hz
+float x_shaper_damping = 0.1;
+int y_shaper_type = 0;
+float y_shaper_frequency = 40.0; //Hz
+float y_shaper_damping = 0.1;
+
+//Mesh bed leveling, see BedMesh.h. G29 probes a grid of MESH_POINTS_X x MESH_POINTS_Y points from mesh_min to
+//mesh_max with the Z min endstop (Z_MIN_PIN in pins.h), which has to trigger where the nozzle touches the bed.
+//Each probe starts mesh_probe_height above Z0 and goes down at most as far below it. The correction fades out
+//up to mesh_fade_height (0 never fades), M420 turns it on and off
+#define MESH_POINTS_X 5
+#define MESH_POINTS_Y 5
+float mesh_min_x = 10.0; //mm
+float mesh_max_x = 190.0;
+float mesh_min_y = 10.0;
+float mesh_max_y = 190.0;
+float mesh_fade_height = 10.0; //mm
+float mesh_probe_height = 5.0; //mm
+float mesh_probe_feedrate = 120.0; //mm/min
+float mesh_travel_feedrate = 6000.0; //mm/min
+
+//PID temperature control, output 0 to PID_MAX per degree C. The gains can be changed with M301 (hot-end)
+//and M304 (bed), M303 measures them.
+float hotend_kp = 22.2;
+float hotend_ki = 1.08;
+float hotend_kd = 114.0;
+float bed_kp = 10.0;
+float bed_ki = 0.023;
+float bed_kd = 305.4;
+#define PID_MAX 255 //heater fully on
+#define PID_FUNCTIONAL_RANGE 10 //degrees C, further away from the target the heater is simply fully on or off
+#define TEMP_WINDOW 1.0 //degrees C below the target that count as reached for M109 and M190
+#define TEMP_RESIDENCY_TIME 3000 //ms it has to stay there, so that the overshoot of a fast approach is over
+
+//Printing from a file with M20-M27. "/local" is the mbed's own flash drive, an SD card
+//works the same way with the SDFileSystem library mounted as "/sd".
+#ifndef FILE_SYSTEM_ROOT // the simulator has its own
+#define FILE_SYSTEM_ROOT "/local"
+#endif
+#define FILE_BLOCK_SIZE 512 //bytes read at a time, one block is parsed while the other one is read ahead
+
+//Maximum acceleration of each axis in mm/s^2, can be changed with M201
+float x_max_acceleration = 3000.0;
+float y_max_acceleration = 3000.0;
+float z_max_acceleration = 100.0;
+float e_max_acceleration = 10000.0;
+
 //For Inverting Stepper Enable Pins (Active Low) use 0, Non Inverting (Active High) use 1
 const bool X_ENABLE_ON = 0;
 const bool Y_ENABLE_ON = 0;
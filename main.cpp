@@ -4,48 +4,48 @@
 // Licence: GPL
 // ported to mbed by R. Bohne (rene.bohne@gmail.com)
 
+#ifdef SIMULATOR
+#include "sim/sim_mbed.h" // runs on a PC, see sim/README
+#else
 #include "mbed.h"
+#endif
+#include <stdarg.h>
 #include "pins.h"
 #include "configuration.h"
 #include "ThermistorTable.h"
+#include "BinaryProtocol.h"
+#include "EventTrace.h"
+#include "InputShaper.h"
+#include "Kinematics.h"
+#include "Axis.h"
+#include "BedMesh.h"
 
 
 #define DEBUGGING false
 
-#define X_TIME_FOR_MOVE ((float)x_steps_to_take / (x_steps_per_unit*feedrate/60000000))
-#define Y_TIME_FOR_MOVE ((float)y_steps_to_take / (y_steps_per_unit*feedrate/60000000))
-#define Z_TIME_FOR_MOVE ((float)z_steps_to_take / (z_steps_per_unit*feedrate/60000000))
-#define E_TIME_FOR_MOVE ((float)e_steps_to_take / (e_steps_per_unit*feedrate/60000000))
+typedef Kinematics<KINEMATICS> machine; // see Kinematics.h
 
 
-DigitalOut led1(LED1);//x
-DigitalOut led2(LED2);//y
-DigitalOut led3(LED3);//z
-DigitalOut led4(LED4);//e
+// The stepper axes, see Axis.h. Their order gives the X_AXIS_BIT... below, pins from pins.h and the
+// LEDs of the mbed show which axes are moving.
+typedef Axis<AxisPins<X_STEP_PIN, X_DIR_PIN, X_ENABLE_PIN, X_MIN_PIN, LED1>, AxisConfig<INVERT_X_DIR, X_ENABLE_ON, DISABLE_X> > x_axis;
+typedef Axis<AxisPins<Y_STEP_PIN, Y_DIR_PIN, Y_ENABLE_PIN, Y_MIN_PIN, LED2>, AxisConfig<INVERT_Y_DIR, Y_ENABLE_ON, DISABLE_Y> > y_axis;
+typedef Axis<AxisPins<Z_STEP_PIN, Z_DIR_PIN, Z_ENABLE_PIN, Z_MIN_PIN, LED3>, AxisConfig<INVERT_Z_DIR, Z_ENABLE_ON, DISABLE_Z> > z_axis;
+typedef Axis<AxisPins<E_STEP_PIN, E_DIR_PIN, E_ENABLE_PIN, NC, LED4>, AxisConfig<INVERT_E_DIR, E_ENABLE_ON, DISABLE_E> > e_axis;
+typedef AxisList<x_axis, AxisList<y_axis, AxisList<z_axis, AxisList<e_axis> > > > axes_list;
 
-DigitalOut p_fan(FAN_PIN);
-
-DigitalOut p_X_enable(X_ENABLE_PIN);
-DigitalOut p_X_dir(X_DIR_PIN);
-DigitalOut p_X_step(X_STEP_PIN);
-DigitalIn p_X_min(X_MIN_PIN);
-DigitalIn p_X_max(X_MAX_PIN);
-
-DigitalOut p_Y_enable(Y_ENABLE_PIN);
-DigitalOut p_Y_dir(Y_DIR_PIN);
-DigitalOut p_Y_step(Y_STEP_PIN);
-DigitalIn p_Y_min(Y_MIN_PIN);
-DigitalIn p_Y_max(Y_MAX_PIN);
-
-DigitalOut p_Z_enable(Z_ENABLE_PIN);
-DigitalOut p_Z_dir(Z_DIR_PIN);
-DigitalOut p_Z_step(Z_STEP_PIN);
-DigitalIn p_Z_min(Z_MIN_PIN);
-DigitalIn p_Z_max(Z_MAX_PIN);
+#define NUM_AXES axes_list::count
+#define X_AXIS 0
+#define Y_AXIS 1
+#define Z_AXIS 2
+#define E_AXIS 3
+#define X_AXIS_BIT (1 << X_AXIS)
+#define Y_AXIS_BIT (1 << Y_AXIS)
+#define Z_AXIS_BIT (1 << Z_AXIS)
+#define E_AXIS_BIT (1 << E_AXIS)
+#define ALL_AXES ((1 << NUM_AXES) - 1)
 
-DigitalOut p_E_enable(E_ENABLE_PIN);
-DigitalOut p_E_dir(E_DIR_PIN);
-DigitalOut p_E_step(E_STEP_PIN);
+DigitalOut p_fan(FAN_PIN);
 
 DigitalOut p_heater0(HEATER_0_PIN);
 DigitalOut p_heater1(HEATER_1_PIN);//heated-build-platform
@@ -54,15 +54,41 @@ AnalogIn p_temp0(TEMP_0_PIN);
 AnalogIn p_temp1(TEMP_1_PIN);//heated-build-platform thermistor
 
 
-Serial pc(USBTX, USBRX);
+// Serial that counts the time spent in printf(), see M122. A line that doesn't fit into the
+// transmit FIFO blocks until the rest of it is sent, at 57600 baud that is 174 us per character.
+class TimedSerial : public Serial {
+public:
+    TimedSerial(PinName tx, PinName rx) : Serial(tx, rx) {}
+    int printf(const char *format, ...);
+};
+
+TimedSerial pc(USBTX, USBRX);
+LocalFileSystem local("local");
 
 Timer timer;
 
-int millis() {
-    return timer.read_ms();
+// 64 bit microsecond clock. The microseconds of timer wrap every 2^32 us (71 minutes), clock_high counts
+// the wraps. micros64() has to be called at least once in that time, heater_pwm_isr() does it every period.
+// read_us() returns an int, it is kept in 32 bits so that it doesn't sign extend where long has 64.
+volatile unsigned long clock_high = 0;
+volatile uint32_t clock_last = 0;
+
+unsigned long long micros64() {
+    __disable_irq();
+    uint32_t now = timer.read_us();
+    if (now < clock_last) clock_high++;
+    clock_last = now;
+    unsigned long long result = ((unsigned long long)clock_high << 32) | now;
+    __enable_irq();
+    return result;
+}
+
+// Both wrap around, compare them as differences like millis() - previous_millis_cmd
+unsigned long millis() {
+    return micros64()/1000;
 }
 
-int micros() {
+unsigned long micros() {
     return timer.read_us();
 }
 
@@ -73,46 +99,16 @@ int max(int a, int b) {
     return b;
 }
 
-// Takes temperature value as input and returns corresponding analog value from RepRap thermistor temp table.
-// This is needed because PID in hydra firmware hovers around a given analog value, not a temp value.
-// This function is derived from inversing the logic from a portion of getTemperature() in FiveD RepRap firmware.
-float temp2analog(int celsius) {
-    if (USE_THERMISTOR){
-        int raw = 0;
-        int i;
-
-        for (i=1; i<NUMTEMPS; i++) {
-            if (temptable[i][1] < celsius) {
-                raw = temptable[i-1][0];
-                break;
-            }
-        }
-
-        // Overflow: Set to last value in the table (25 deg. Celsius)
-        if (i == NUMTEMPS) raw = temptable[i-1][0];
-
-        return raw;
-    } 
-}
-
-// calculated by hand
+// Temperature of a reading, interpolated between the two table entries around it
 float analog2temp(int raw) {
     if (USE_THERMISTOR) {
-        int celsius = 0;
-        int i;
-
-        for (i=1; i<NUMTEMPS; i++) {
-            if (temptable[i][0]  > raw) {
-                celsius  = temptable[i-1][1];
-                break;
-            }
-        }
-
-        // Overflow: Set to last value in the table (25 deg. Celsius)
-        if (i == NUMTEMPS) celsius = temptable[i-1][1];
+        int i = raw/TEMPTABLE_STEP;
+        if (i > NUMTEMPS - 2) i = NUMTEMPS - 2;
+        float fraction = (float)(raw - i*TEMPTABLE_STEP)/TEMPTABLE_STEP;
 
-        return celsius;
-    } 
+        return temptable[i] + (temptable[i + 1] - temptable[i])*fraction;
+    }
+    return 0;
 }
 
 // look here for descriptions of gcodes: http://linuxcnc.org/handbook/gcode/g-code.html
@@ -122,7 +118,10 @@ float analog2temp(int raw) {
 //-------------------
 // G0 -> G1
 // G1  - Coordinated Movement X Y Z E
+// G2  - Clockwise arc X Y Z E with the center offset I J or the radius R
+// G3  - Counter-clockwise arc
 // G4  - Dwell S<seconds> or P<milliseconds>
+// G29 - Probe the bed mesh with the Z min endstop, Z0 is where it triggers at the first point, see BedMesh.h
 // G90 - Use Absolute Coordinates
 // G91 - Use Relative Coordinates
 // G92 - Set current position to cordinates given
@@ -133,8 +132,15 @@ float analog2temp(int raw) {
 // M106 - Fan on
 // M107 - Fan off
 // M109 - Wait for current temp to reach target temp.
+// M190 - Wait for the bed to reach its target temp, S<temperature> sets it first
 
 //Custom M Codes
+// M20  - List the files in FILE_SYSTEM_ROOT
+// M23  - Select a file to print, M23 filename.g
+// M24  - Start or resume printing the selected file
+// M25  - Pause printing the file
+// M26  - Set the position in the file to S<byte>
+// M27  - Report the progress of the file print
 // M80  - Turn on Power Supply
 // M81  - Turn off Power Supply
 // M82  - Set E codes absolute (default)
@@ -143,309 +149,544 @@ float analog2temp(int raw) {
 // M85  - Set inactivity shutdown timer with parameter S<seconds>. To disable set zero (default)
 // M86  - If Endstop is Not Activated then Abort Print. Specify X and/or Y
 // M92  - Set axis_steps_per_unit - same syntax as G92
-// M93  - Read previous_micros
+// M201 - Set maximum acceleration in mm/s^2 per axis - same syntax as G92
+// M204 - Set default acceleration in mm/s^2 with parameter S<acceleration>
+// M301 - Set the hot-end PID gains P I D
+// M303 - PID autotune, S<temperature> C<cycles> E<0 hot-end, 1 bed>, prints the gains it found
+// M304 - Set the bed PID gains P I D
+// M122 - Print the timing statistics and clear them: step lateness per axis, loop() time, manage_heater() gap, printf() time
+// M860 - Receive binary packets (S1, default) or ASCII lines (S0) from now on, see BinaryProtocol.h
+// M870 - Start recording the event types in the bit mask S (all without S) and clear the trace, S0 stops, see EventTrace.h
+// M871 - Stop recording and send the event trace
+// M900 - Set the pressure advance factor K<seconds>, 0 turns it off
+// M420 - Turn the bed mesh correction on (S1) or off (S0), Z<fade height>, prints the mesh
+// M593 - Set the input shaper of X and/or Y (both without X and Y): T<0 off, 1 ZV, 2 MZV, 3 EI> F<Hz> D<damping ratio>
 
 //Stepper Movement Variables
-bool direction_x, direction_y, direction_z, direction_e;
-int previous_micros=0, previous_micros_x=0, previous_micros_y=0, previous_micros_z=0, previous_micros_e=0, previous_millis_heater;
-int x_steps_to_take, y_steps_to_take, z_steps_to_take, e_steps_to_take;
+long position_x = 0, position_y = 0, position_z = 0, position_e = 0; // in steps, at the end of the last queued move
 float destination_x =0.0, destination_y = 0.0, destination_z = 0.0, destination_e = 0.0;
 float current_x = 0.0, current_y = 0.0, current_z = 0.0, current_e = 0.0;
-float x_interval, y_interval, z_interval, e_interval; // for speed delay
+float destination_mesh_z = 0.0; // bed mesh correction of the Z target, set by prepare_move()
 float feedrate = 1500, next_feedrate;
-float time_for_move;
 int gcode_N, gcode_LastN;
 bool relative_mode = false;  //Determines Absolute or Relative Coordinates
 bool relative_mode_e = false;  //Determines Absolute or Relative E Codes while in Absolute Coordinates mode. E is always relative in Relative Coordinates mode.
 
-int x_steps_remaining;
-int y_steps_remaining;
-int z_steps_remaining;
-int e_steps_remaining;
+//Planner variables
+// A linear move queued by plan_buffer_line() and executed by stepper_isr()
+struct block_t {
+    int steps_to_take[NUM_AXES]; // X_AXIS...
+    int step_event_count; // the largest of the steps_to_take
+    bool direction[NUM_AXES]; // true = forward
+
+    float millimeters; // length of the move
+    float nominal_speed; // mm/s
+    float entry_speed; // mm/s at the junction with the previous block
+    float exit_speed; // mm/s at the junction with the next block
+    float max_entry_speed; // junction speed limit, see plan_buffer_line()
+    bool nominal_length_flag; // block is long enough to reach nominal_speed from a standstill
+    bool recalculate_flag; // entry or exit speed changed since the last recalculation
+    volatile bool busy; // being executed by stepper_isr(), its profile must not change any more
+
+    float acceleration; // mm/s^2
+    int acceleration_st; // steps/s^2 of the axis with the most steps
+    unsigned long acceleration_rate; // acceleration_st in the fixed point format of rate_delta()
+    int nominal_rate; // steps/s of the axis with the most steps
+    int initial_rate; // steps/s at the start of the block
+    int final_rate; // steps/s at the end of the block
+    int accelerate_until; // step event count at which to stop accelerating
+    int decelerate_after; // step event count at which to start decelerating
+    unsigned long advance_rate; // pressure advance in E steps per step rate, 16.16 fixed point, 0 = none
+};
+
+#define MINIMUM_PLANNER_SPEED 0.05 // mm/s, speed at the start and end of the queue
+#define PLANNER_IDLE_TIME 100 // ms without new moves before the queue is executed anyway
+#define ARC_CORRECTION_SEGMENTS 25 // G2/G3 segments between exact sin/cos, see arc_move()
+#define ARC_ANGLE_EPSILON 0.000001 // radians, smaller arcs are full circles
+#define PI 3.14159265
+#define STEP_INTERVAL_SCALE 4096000000UL // (1/16 steps/s) * (1/256 us), see stepper_isr()
+#define ACCELERATION_RATE_SCALE 17592186UL // 2^32/(16*10^6) in 16.16 fixed point, see rate_delta()
+
+// Timer 2 runs at CCLK/STEP_TIMER_PRESCALE = 24 MHz
+#define STEP_TIMER_PRESCALE 4
+#define STEP_TIMER_TICKS_PER_US 24
+#define STEP_TIMER_TICKS(interval) (((interval)*3) >> 5) // 1/256 us to timer ticks
+#define NS_TO_STEP_TIMER_TICKS(ns) (((ns)*STEP_TIMER_TICKS_PER_US + 999)/1000)
+#define STEP_PULSE_TICKS NS_TO_STEP_TIMER_TICKS(STEP_PULSE_NS)
+#define DIRECTION_SETUP_TICKS NS_TO_STEP_TIMER_TICKS(DIRECTION_SETUP_NS)
+#define MIN_EDGE_TICKS (STEP_TIMER_TICKS_PER_US/2) // an edge is scheduled at least this far ahead, see pulse_schedule()
+
+// Highest step rate of the leading axis, faster moves are slowed down by the planner. One step
+// event takes a few us in stepper_isr() and the edges of its pulse a fraction of that in the
+// MR1 interrupts, which leaves more than half of the CPU time to the main loop at this rate.
+#define MAX_STEP_FREQUENCY 40000
+
+block_t block_buffer[BLOCK_BUFFER_SIZE];
+volatile int block_buffer_head = 0; // index of the next block to be queued
+volatile int block_buffer_tail = 0; // index of the block being executed by stepper_isr()
+float previous_unit_x = 0.0, previous_unit_y = 0.0, previous_unit_z = 0.0; // direction of the last queued move
+float previous_nominal_speed = 0.0;
+unsigned long previous_millis_planner = 0;
+
+//Stepper interrupt variables, see stepper_isr()
+block_t *current_block = NULL; // block being executed, NULL between blocks
+volatile bool stepper_running = false;
+int step_events_completed;
+axis_state_t axis_state[NUM_AXES]; // X_AXIS...
+unsigned long step_rate, nominal_step_rate, final_step_rate; // 1/16 steps/s
+unsigned long step_interval; // 1/256 us
+long advance_steps = 0; // E steps pushed out ahead by pressure advance
+unsigned long step_time = 0; // step timer ticks from st_wake_up() to this interrupt
+unsigned long block_step_due = 0; // step_time of the next step event of the current block
+
+//Step pulses, their edges come at the MR1 matches of the step timer, see pulse_start()
+int pulse_axes = 0; // axes (X_AXIS_BIT...) of the pulse in progress, 0 = none
+bool pulse_high = false; // the step pins of pulse_axes are high and go low at the match, or else go high at it
+int pulse_advance = 0; // E step of pressure advance after the pulse, 1 forward or -1 backwards
+bool pulse_e_backwards = false; // the pulse is a backwards E step, the E direction goes forward again after it
+int direction_pins_high = 0; // axes (X_AXIS_BIT...) with the direction pin high
+unsigned long direction_changed = 0; // step_time + TC when a direction pin changed last
+unsigned long pulse_fell = 0; // step_time + TC when the step pins went low last
+
+//Input shaping, see InputShaper.h and update_input_shapers()
+int shaped_axes = 0; // X_AXIS_BIT and Y_AXIS_BIT of the axes with an input shaper
+int shaped_dir_high = 0; // direction pins of the shaped axes, they follow the shaped steps and not the blocks
+unsigned long shaper_max_rate = MAX_STEP_FREQUENCY; // step events/s the shaper queue can keep up with
+
+//Fixed point copies of the axis settings for plan_buffer_line(), see update_axis_constants()
+unsigned long x_um_per_step, y_um_per_step, z_um_per_step, e_um_per_step; // micrometers per step, 16.16 fixed point
+unsigned long x_max_acceleration_st, y_max_acceleration_st, z_max_acceleration_st, e_max_acceleration_st; // steps/s^2
+unsigned long acceleration_um; // um/s^2
 
 // comm variables
 #define MAX_CMD_SIZE 256
-char cmdbuffer[MAX_CMD_SIZE];
+#define BUFSIZE 8 // number of received commands waiting to be processed
+#define RX_BUFFER_SIZE 256 // bytes received by serial_rx_isr() but not yet read by get_command(), must be a power of 2
+char rx_buffer[RX_BUFFER_SIZE];
+volatile int rx_buffer_head = 0, rx_buffer_tail = 0;
+char cmdbuffer[BUFSIZE][MAX_CMD_SIZE];
+bool cmd_acknowledged[BUFSIZE]; // ok was sent when the command was queued
+int bufindr = 0; // command being processed
+int bufindw = 0; // command being received
+int buflen = 0; // number of complete commands in cmdbuffer
 char serial_char;
 int serial_count = 0;
 bool comment_mode = false;
-char *strchr_pointer; // just a pointer to find chars in the cmd string like X, Y, Z, E, etc
+
+// A received line after parse_command(), so the words don't have to be searched again for every code_seen()
+typedef struct {
+    unsigned long seen; // bit n is set if letter 'A'+n is in the line
+    float value[26]; // number behind each letter, 0.0 if the letter has none
+    long line_number; // N
+    bool has_checksum;
+    int checksum; // xor of all characters in front of the '*'
+    int checksum_received; // number behind the '*'
+} command_t;
+
+command_t commands[BUFSIZE]; // parsed copies of cmdbuffer
+command_t *command; // the command being processed, used by code_seen() and code_value()
+int code_letter; // letter found by the last code_seen(), 0 = 'A'
+bool binary_mode = false; // commands arrive as packets from BinaryProtocol.h, set by M860
+
+// print from file variables, see get_file_commands()
+FILE *print_file = NULL;
+bool file_printing = false; // M24 started and M25 didn't pause
+char file_block[2][FILE_BLOCK_SIZE];
+int file_block_length[2]; // bytes in each block, 0 = still has to be read
+int file_block_read = 0; // block the commands are taken from, the other one is read ahead
+int file_block_pos = 0;
+long file_position = 0; // bytes of the file that went into commands
+long file_size = 0;
+long file_lines = 0; // commands queued from the file
+unsigned long long file_time = 0; // us spent printing the file, without the pauses
+unsigned long long file_time_started; // micros64() at the last M24
+
+void run_tasks(); // keeps reading the host and controlling the heaters while a command waits, see st_synchronize()
 
 //manage heater variables
-int target_raw = 0;
-int current_raw;
+#define HEATER_PWM_TICK_US 500 // heater_pwm_isr() interval
+#define HEATER_PWM_STEPS 256 // ticks per PWM period, the PID runs once per period
+#define PID_INTERVAL (HEATER_PWM_STEPS*HEATER_PWM_TICK_US/1000000.0) // s
+#define ADC_SAMPLE_TICKS 4 // ticks between two thermistor samples, the channels take turns, must be a power of 2
+
+typedef struct {
+    float target; // degrees C, 0 = off
+    float temperature; // degrees C, measured by the last PID update
+    float previous_temperature;
+    float integral; // sum of error*PID_INTERVAL, limited so it can't wind up
+    bool manual; // duty is set by M303 and not by the PID
+    volatile int duty; // 0 to PID_MAX, switched by heater_pwm_isr()
+
+    // thermistor readings, sampled by heater_pwm_isr() and published once per PWM period
+    unsigned short samples[2]; // previous two samples, for the median
+    long sample_sum;
+    int sample_count;
+    volatile int raw; // filtered reading of the last period
+    volatile bool fault; // raw is outside of THERMISTOR_SHORT_RAW..THERMISTOR_OPEN_RAW
+    bool fault_reported;
+} heater_t;
+
+heater_t heater0, heater1; // hot-end, heated-build-platform
+Ticker heater_ticker;
+int heater_pwm_count = 0;
+volatile unsigned long heater_pwm_periods = 0; // counts up once per PWM period
+unsigned long heater_pid_period = 0; // period of the last PID update
+
+// Timing statistics, printed and cleared by M122. A histogram counts times in us in buckets of powers
+// of 2: bucket 0 below 1 us, bucket n from 2^(n-1) up to 2^n us, the last one everything longer.
+#define HISTOGRAM_BUCKETS 12
+
+typedef struct {
+    unsigned long count[HISTOGRAM_BUCKETS];
+    unsigned long max; // us
+} histogram_t;
+
+volatile histogram_t step_late[4]; // X, Y, Z, E: from the time stepper_isr() scheduled a step to its pulse
+unsigned long step_late_ticks = 0; // the next step is late by this much already, see stepper_isr()
+histogram_t loop_time; // one pass of loop()
+unsigned long loop_started = 0;
+unsigned long manage_heater_gap_max = 0; // us between two calls of manage_heater()
+unsigned long manage_heater_called = 0;
+unsigned long printf_calls = 0;
+unsigned long printf_time = 0, printf_time_max = 0; // us
+
+int histogram_bucket(unsigned long us) {
+    int bucket = 0;
+    while (us && bucket < HISTOGRAM_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
 
-//for heated-build-platform
-int target_raw1 = 0;
-int current_raw1;
+void histogram_add(volatile histogram_t *histogram, int bucket, unsigned long us) {
+    histogram->count[bucket]++;
+    if (us > histogram->max) histogram->max = us;
+}
+
+int TimedSerial::printf(const char *format, ...) {
+    unsigned long start = micros();
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    puts(text);
+
+    unsigned long time = micros() - start;
+    printf_calls++;
+    printf_time += time;
+    if (time > printf_time_max) printf_time_max = time;
+    return length;
+}
 
 
 //Inactivity shutdown variables
-int previous_millis_cmd=0;
-int max_inactive_time = 0;
-
-//timer.read_us overflows every 30 seconds, so we want to reset everything...
-void reset_timers() {
-    previous_micros = 0;
-    previous_micros_x = 0;
-    previous_micros_y = 0;
-    previous_micros_z = 0;
-    previous_micros_e = 0;
-
-    timer.stop();
-    timer.reset();
-    timer.start();
-}
+unsigned long previous_millis_cmd=0;
+unsigned long max_inactive_time = 0;
 
+//Commands that wait (G4, M109, M190), see wait_for()
+void (*wait_start)() = NULL; // runs once the moves in front of the command are done
+bool (*command_wait)() = NULL; // the command is done once this returns true, NULL = no command waits
+bool wait_moves_done = false; // the wait has started
+unsigned long wait_started = 0; // millis() when it started
+unsigned long dwell_time = 0; // ms, G4
+heater_t *wait_heater = NULL; // M109, M190
+float wait_target = 0; // degrees C, becomes the target of wait_heater when the wait starts
+bool wait_in_window = false; // wait_heater is within TEMP_WINDOW of its target
+unsigned long wait_window_entered = 0; // millis() when it got there
 
-void check_x_min_endstop() {
-    if (X_MIN_PIN != NC) {
-        if (!direction_x) {
-            if (p_X_min.read() != ENDSTOPS_INVERTING) {
-                x_steps_remaining=0;
-            }
-        }
-    }
+
+
+//manages heaters for hot-end and heated-build-platform
+// Take a thermistor sample and add the median of it and the two before it to the average of this period.
+// The median keeps single spikes from the ADC out of the average.
+void sample_thermistor(heater_t *heater, AnalogIn &input) {
+    int a = input.read_u16(), b = heater->samples[0], c = heater->samples[1];
+    TRACE(TRACE_ADC, heater == &heater1, a);
+    int median = (a > b) ? ((b > c) ? b : ((a > c) ? c : a)) : ((a > c) ? a : ((b > c) ? c : b));
+    heater->samples[1] = b;
+    heater->samples[0] = a;
+    heater->sample_sum += median;
+    heater->sample_count++;
 }
 
-void check_y_min_endstop() {
-    if (Y_MIN_PIN != NC) {
-        if (!direction_y) {
-            if (p_Y_min.read() != ENDSTOPS_INVERTING) {
-                y_steps_remaining=0;
-            }
-        }
+// Make the average of this period the reading everybody uses
+void publish_thermistor(heater_t *heater) {
+    if (heater->sample_count) {
+        heater->raw = heater->sample_sum/heater->sample_count;
+        heater->fault = (heater->raw >= THERMISTOR_OPEN_RAW || heater->raw <= THERMISTOR_SHORT_RAW);
     }
+    heater->sample_sum = 0;
+    heater->sample_count = 0;
 }
 
-void check_z_min_endstop() {
-    if (Z_MIN_PIN != NC) {
-        if (!direction_z) {
-            if (p_Z_min.read() != ENDSTOPS_INVERTING) {
-                z_steps_remaining=0;
-            }
+// Software PWM for both heaters, HEATER_PWM_STEPS ticks per period, and the thermistor sampling.
+// The ADC conversions happen here, so manage_heater() never waits for them.
+void heater_pwm_isr() {
+    if (++heater_pwm_count == HEATER_PWM_STEPS) {
+        heater_pwm_count = 0;
+        publish_thermistor(&heater0);
+        publish_thermistor(&heater1);
+        heater_pwm_periods++;
+        micros64(); // keeps the clock from missing a wrap
+    }
+    // duty is 0 to PID_MAX, the counter runs to HEATER_PWM_STEPS
+    int level = heater_pwm_count*(PID_MAX + 1)/HEATER_PWM_STEPS;
+    int on0 = (heater0.duty > level);
+    int on1 = (heater1.duty > level);
+    if (TRACING(TRACE_HEATER)) {
+        if (HEATER_0_PIN != NC && on0 != p_heater0) trace_record(TRACE_HEATER, 0, on0);
+        if (HEATER_1_PIN != NC && on1 != p_heater1) trace_record(TRACE_HEATER, 1, on1);
+    }
+    p_heater0 = on0;
+    p_heater1 = on1;
+
+    if (!(heater_pwm_count & (ADC_SAMPLE_TICKS - 1))) {
+        if (heater_pwm_count & ADC_SAMPLE_TICKS) {
+            if (TEMP_1_PIN != NC) sample_thermistor(&heater1, p_temp1);
+        } else {
+            if (TEMP_0_PIN != NC) sample_thermistor(&heater0, p_temp0);
         }
     }
 }
 
+// One PID step for heater with the reading of the last period
+void pid_update(heater_t *heater, float kp, float ki, float kd) {
+    float output;
 
+    if (heater->fault) {
+        if (!heater->fault_reported) pc.printf("thermistor%d disconnected or shorted!!!\n", heater == &heater0 ? 0 : 1);
+        heater->fault_reported = true;
+        heater->duty = 0;
+        return;
+    }
+    heater->fault_reported = false;
 
-//manages heaters for hot-end and heated-build-platform
-void manage_heater() {
-
-    if (TEMP_0_PIN != NC) {
-        current_raw = 0;
-        for(int i=0;i<3;i++)
-        {
-            int _raw = p_temp0.read_u16();
-            if((current_raw == 65535) && (_raw==65535))
-            {
-               //do nothing
-            }
-            else if((current_raw == 65535) && (_raw<65535))
-            {
-                current_raw = _raw;
-            }
-            else
-            {
-                long l = current_raw + _raw;
-                l = l/2;
-                current_raw = (int) l;
-            }
-        }
-        //pc.printf("currentRaw: %d \t targetRaw: %d\n", current_raw, target_raw);
-        
-    
-        if(current_raw == 65535)
-        {
-           pc.printf("thermistor0 disconnected!!!\n");
-           p_heater0 = 0;
-        }
-        else
-        {
-            
-        if((target_raw >0) && (current_raw > target_raw))
-        {
-            p_heater0 = 1;
-            //pc.printf("currentRaw: %d \t targetRaw: %d\n", current_raw, target_raw);
-        }
-        else
-        {
-          p_heater0 = 0;
-        }
-        }
-        
-    }
-	
-	//thermistor for heated-build-platform
-	if (TEMP_1_PIN != NC) {
-        current_raw1 = 0;
-        for(int i=0;i<3;i++)
-        {
-            int _raw1 = p_temp1.read_u16();
-            if((current_raw1 == 65535) && (_raw1==65535))
-            {
-				//do nothing
-            }
-            else if((current_raw1 == 65535) && (_raw1<65535))
-            {
-                current_raw1 = _raw1;
-            }
-            else
-            {
-                long l = current_raw1 + _raw1;
-                l = l/2;
-                current_raw1 = (int) l;
-            }
-        }
-        //pc.printf("currentRaw1: %d \t targetRaw1: %d\n", current_raw1, target_raw1);
-        
-		
-        if(current_raw1 == 65535)
-        {
-			pc.printf("thermistor1 disconnected!!!\n");
-			p_heater1 = 0;
-        }
-        else
-        {
-            
-			if((target_raw1 >0) && (current_raw1 > target_raw1))
-			{
-				p_heater1 = 1;
-				//pc.printf("currentRaw: %d \t targetRaw: %d\n", current_raw, target_raw);
-			}
-			else
-			{
-				p_heater1 = 0;
-			}
-        }
-        
-    }
-
-/*
-    if (TEMP_0_PIN != NC) {
-        current_raw = (p_temp0.read_u16() >> 6) ;
-
-        if (USE_THERMISTOR) {// If using thermistor, when the heater is colder than targer temp, we get a higher analog reading than target,
-            current_raw = 0xFFFF - current_raw; // this switches it up so that the reading appears lower than target for the control logic.
-        }
+    heater->temperature = analog2temp(heater->raw);
+    float error = heater->target - heater->temperature;
 
-        if (current_raw >= target_raw) {
-            p_heater0 = 0;
-        } else {
-            p_heater0 = 1;
+    if (heater->target <= 0 || error < -PID_FUNCTIONAL_RANGE) {
+        output = 0;
+        heater->integral = 0;
+    } else if (error > PID_FUNCTIONAL_RANGE) {
+        output = PID_MAX;
+        heater->integral = 0;
+    } else {
+        // The integral is limited to what the I term alone can drive, so it can't wind up
+        heater->integral += error*PID_INTERVAL;
+        if (ki > 0) {
+            if (heater->integral*ki > PID_MAX) heater->integral = PID_MAX/ki;
+            if (heater->integral < 0) heater->integral = 0;
         }
+        // The D term works on the temperature and not the error, so a new target doesn't kick it
+        output = kp*error + ki*heater->integral - kd*(heater->temperature - heater->previous_temperature)/PID_INTERVAL;
+        if (output > PID_MAX) output = PID_MAX;
+        if (output < 0) output = 0;
     }
-*/
+    heater->previous_temperature = heater->temperature;
 
+    if (!heater->manual) heater->duty = (int)output;
 }
 
+// Run the PID once per PWM period, when heater_pwm_isr() has published new readings
+void manage_heater() {
+    unsigned long now = micros();
+    if (now - manage_heater_called > manage_heater_gap_max) manage_heater_gap_max = now - manage_heater_called;
+    manage_heater_called = now;
+
+    if (heater_pid_period == heater_pwm_periods) return;
+    heater_pid_period = heater_pwm_periods;
 
-void do_x_step() {
-    if (X_STEP_PIN != NC) {
-        p_X_step = 1;
-        wait_us(2);
-        p_X_step = 0;
-        //wait_us(2);
-        previous_micros_x = micros();
+    if (TEMP_0_PIN != NC) {
+        pid_update(&heater0, hotend_kp, hotend_ki, hotend_kd);
     }
-}
 
-void do_y_step() {
-    if (Y_STEP_PIN != NC) {
-        p_Y_step = 1;
-        wait_us(2);
-        p_Y_step = 0;
-        //wait_us(2);
-        previous_micros_y = micros();
+    //thermistor for heated-build-platform
+    if (TEMP_1_PIN != NC) {
+        pid_update(&heater1, bed_kp, bed_ki, bed_kd);
     }
 }
 
-void do_z_step() {
-    if (Z_STEP_PIN != NC) {
-        p_Z_step = 1;
-        wait_us(2);
-        p_Z_step = 0;
-        //wait_us(2);
-        previous_micros_z = micros();
-    }
+
+// Step timer ticks since st_wake_up()
+inline unsigned long step_timer_now() {
+    return step_time + LPC_TIM2->TC;
 }
 
-void do_e_step() {
-    if (E_STEP_PIN != NC) {
-        p_E_step = 1;
-        wait_us(2);
-        p_E_step = 0;
-        //wait_us(2);
-        previous_micros_e = micros();
+// Raise or lower the step pins of all axes in axes (X_AXIS_BIT...) at the same time,
+// with one FIOSET or FIOCLR write for each GPIO port that has one of the pins
+void set_step_pins(int axes, bool high) {
+    unsigned long masks[GPIO_PORTS] = {0, 0, 0, 0, 0};
+    axes_list::add_step_pins(masks, axes);
+
+    for (int port = 0; port < GPIO_PORTS; port++) {
+        if (!masks[port]) continue;
+        if (high) gpio_port[port]->FIOSET = masks[port];
+        else gpio_port[port]->FIOCLR = masks[port];
     }
 }
 
+// Set the direction pins of the axes in high (X_AXIS_BIT...) and clear the other ones of axes, one write per port and level
+void set_direction_pins(int high, int axes = ALL_AXES) {
+    if ((high ^ direction_pins_high) & axes) direction_changed = step_timer_now();
+    direction_pins_high = (direction_pins_high & ~axes) | (high & axes);
+
+    unsigned long set[GPIO_PORTS] = {0, 0, 0, 0, 0};
+    unsigned long clear[GPIO_PORTS] = {0, 0, 0, 0, 0};
+    axes_list::add_dir_pins(set, clear, high, axes);
 
-void disable_x() {
-    if (X_ENABLE_PIN != NC) {
-        p_X_enable = !X_ENABLE_ON;
+    for (int port = 0; port < GPIO_PORTS; port++) {
+        if (set[port]) gpio_port[port]->FIOSET = set[port];
+        if (clear[port]) gpio_port[port]->FIOCLR = clear[port];
     }
-    led1=0;
 }
 
-void disable_y() {
-    if (Y_ENABLE_PIN != NC) {
-        p_Y_enable = !Y_ENABLE_ON;
-    }
-    led2=0;
+// The E direction of a backwards step of pressure advance. It is forward during the blocks.
+void set_e_direction(bool forward) {
+    e_axis::set_direction(forward);
+    direction_changed = step_timer_now();
 }
 
-void disable_z() {
-    if (Z_ENABLE_PIN != NC) {
-        p_Z_enable = !Z_ENABLE_ON;
-    }
-    led3=0;
+// The next edge of the pulse comes at the MR1 match, ticks from now. The match has to lie ahead of
+// the timer once it is written, or it would only come after the timer restarts.
+void pulse_schedule(unsigned long ticks) {
+    if (ticks < MIN_EDGE_TICKS) ticks = MIN_EDGE_TICKS;
+    LPC_TIM2->MR1 = LPC_TIM2->TC + ticks;
+    LPC_TIM2->MCR |= 8; // interrupt on MR1
 }
 
-void disable_e() {
-    if (E_ENABLE_PIN != NC) {
-        p_E_enable = !E_ENABLE_ON;
-    }
-    led4=0;
+void pulse_raise() {
+    set_step_pins(pulse_axes, true);
+    pulse_high = true;
+    pulse_schedule(STEP_PULSE_TICKS);
+}
+
+// Ticks until ticks have passed since the step timer was at since, 0 once they have
+inline unsigned long ticks_left(unsigned long now, unsigned long since, unsigned long ticks) {
+    return now - since < ticks ? ticks - (now - since) : 0;
 }
 
-void  enable_x() {
-    if (X_ENABLE_PIN != NC) {
-        p_X_enable = X_ENABLE_ON;
+// Raise the step pins of pulse_axes once the step pins have been low for STEP_PULSE_TICKS and the
+// direction pins stable for DIRECTION_SETUP_TICKS, right away if that is over already
+void pulse_rise() {
+    unsigned long now = step_timer_now();
+    unsigned long wait = ticks_left(now, pulse_fell, STEP_PULSE_TICKS);
+    unsigned long setup = ticks_left(now, direction_changed, DIRECTION_SETUP_TICKS);
+    if (setup > wait) wait = setup;
+    if (wait) {
+        pulse_high = false;
+        pulse_schedule(wait);
+    } else {
+        pulse_raise();
     }
 }
 
-void  enable_y() {
-    if (Y_ENABLE_PIN != NC) {
-        p_Y_enable = Y_ENABLE_ON;
+// One step pulse on all axes in axes (X_AXIS_BIT...) at the same time, and the E step of pressure advance
+// (1 forward, -1 backwards) as a second pulse after it, or on its own without axes. The rest of the pulses
+// is up to pulse_edge(), stepper_isr() doesn't wait for them.
+void pulse_start(int axes, int advance) {
+    pulse_axes = axes;
+    pulse_advance = advance;
+    if (!axes) {
+        pulse_axes = E_AXIS_BIT;
+        pulse_advance = 0;
+        if (advance < 0) {
+            set_e_direction(false);
+            pulse_e_backwards = true;
+        }
     }
+    pulse_rise();
 }
 
-void  enable_z() {
-    if (Z_ENABLE_PIN != NC) {
-        p_Z_enable = Z_ENABLE_ON;
+// MR1 match: the next edge of the pulse in progress. A pulse goes low after STEP_PULSE_TICKS, an
+// E step of pressure advance follows after the low time, and then the pulses are done.
+void pulse_edge() {
+    if (!pulse_high) { // the low time or the setup time of the direction is over
+        pulse_raise();
+        return;
     }
+    set_step_pins(pulse_axes, false);
+    pulse_high = false;
+    pulse_fell = step_timer_now();
+    if (pulse_e_backwards) {
+        set_e_direction(true);
+        pulse_e_backwards = false;
+    }
+    if (pulse_advance) {
+        pulse_axes = E_AXIS_BIT;
+        if (pulse_advance < 0) {
+            set_e_direction(false);
+            pulse_e_backwards = true;
+        }
+        pulse_advance = 0;
+        pulse_rise();
+        return;
+    }
+    pulse_axes = 0;
+    LPC_TIM2->MCR &= ~8;
+}
+
+// TC when the pulses in progress and the low time after them are over, if the edges come on time
+unsigned long pulse_end() {
+    unsigned long end = LPC_TIM2->MR1 + STEP_PULSE_TICKS;
+    if (!pulse_high) end += STEP_PULSE_TICKS;
+    if (pulse_advance < 0 && DIRECTION_SETUP_TICKS > STEP_PULSE_TICKS) end += DIRECTION_SETUP_TICKS + STEP_PULSE_TICKS;
+    else if (pulse_advance) end += 2*STEP_PULSE_TICKS;
+    return end;
 }
 
-void  enable_e() {
-    if (E_ENABLE_PIN != NC) {
-        p_E_enable = E_ENABLE_ON;
+// Hand the X and Y steps of a step event (axes, 0 between step events) to the input shapers and take
+// the steps the shapers give back instead, see InputShaper.h. The direction pins of the shaped axes are
+// set for these steps here. *next_impulse is set to the ticks until the shapers need the next interrupt,
+// 0 if nothing is queued.
+int shape_steps(int axes, unsigned long *next_impulse) {
+    if (axes & shaped_axes) {
+        unsigned long flags = 0;
+        if (axes & shaped_axes & X_AXIS_BIT) flags |= SHAPER_STEP(0) | (axis_state[X_AXIS].forward ? 0 : SHAPER_BACKWARDS(0));
+        if (axes & shaped_axes & Y_AXIS_BIT) flags |= SHAPER_STEP(1) | (axis_state[Y_AXIS].forward ? 0 : SHAPER_BACKWARDS(1));
+        shaper_add_step_event(step_time, flags);
     }
+    *next_impulse = shaper_update(step_time);
+    axes &= ~shaped_axes;
+
+    int high = shaped_dir_high;
+    int step = (shaped_axes & X_AXIS_BIT) ? shaper_step(0) : 0;
+    if (step) {
+        axes |= X_AXIS_BIT;
+        if (x_axis::dir_high(step > 0)) high |= X_AXIS_BIT;
+        else high &= ~X_AXIS_BIT;
+    }
+    step = (shaped_axes & Y_AXIS_BIT) ? shaper_step(1) : 0;
+    if (step) {
+        axes |= Y_AXIS_BIT;
+        if (y_axis::dir_high(step > 0)) high |= Y_AXIS_BIT;
+        else high &= ~Y_AXIS_BIT;
+    }
+    if (high != shaped_dir_high) {
+        set_direction_pins(high, high ^ shaped_dir_high); // the pulse waits for the setup time
+        shaped_dir_high = high;
+    }
+
+    // Several impulses at once: the next step right after this interrupt
+    if (shaper_behind(0) || shaper_behind(1)) *next_impulse = 1;
+    return axes;
 }
 
 void kill(int debug) {
 
-/*
-    if (HEATER_0_PIN != NC) {
-        p_heater0 = 0;
-    }
-*/
+    heater0.target = heater1.target = 0;
+    heater0.duty = heater1.duty = 0;
 
-    disable_x();
-    disable_y();
-    disable_z();
-    disable_e();
+    // Stop the stepper with the queue emptied, or stepper_isr() would start the next block and enable its axes again
+    LPC_TIM2->TCR = 0;
+    NVIC_DisableIRQ(TIMER2_IRQn);
+    set_step_pins(ALL_AXES, false); // a pulse may have been in progress
+    pulse_axes = 0;
+    current_block = NULL;
+    block_buffer_tail = block_buffer_head;
+    stepper_running = false;
+    axes_list::disable(ALL_AXES);
 
     if (PS_ON_PIN != NC) {
         //pinMode(PS_ON_PIN,INPUT);
@@ -472,6 +713,7 @@ void kill(int debug) {
 }
 
 void manage_inactivity(int debug) {
+    if (command_wait) return; // the host is waiting for the command, not inactive
     if ( (millis()-previous_millis_cmd) >  max_inactive_time ) {
         if (max_inactive_time) {
             kill(debug);
@@ -480,129 +722,709 @@ void manage_inactivity(int debug) {
 }
 
 
-void linear_move() { // make linear move with preset speeds and destinations, see G0 and G1
-    //Determine direction of movement
-    if (destination_x > current_x) {
-        p_X_dir = !INVERT_X_DIR;
-    } else {
-        p_X_dir = INVERT_X_DIR;
-    }
+int next_block_index(int block_index) {
+    return (block_index + 1) & (BLOCK_BUFFER_SIZE - 1);
+}
 
-    if (destination_y > current_y) {
-        p_Y_dir = !INVERT_Y_DIR;
-    } else {
-        p_Y_dir = INVERT_Y_DIR;
-    }
+int prev_block_index(int block_index) {
+    return (block_index - 1) & (BLOCK_BUFFER_SIZE - 1);
+}
 
-    if (destination_z > current_z) {
-        p_Z_dir = !INVERT_Z_DIR;
-    } else {
-        p_Z_dir = INVERT_Z_DIR;
-    }
+bool blocks_queued() {
+    return block_buffer_head != block_buffer_tail;
+}
 
-    if (destination_e > current_e) {
-        p_E_dir = !INVERT_E_DIR;
-    } else {
-        p_E_dir = INVERT_E_DIR;
+// Change of the step rate (1/16 steps/s) during one step interval (1/256 us):
+// rate += acceleration*interval/(16*10^6), with acceleration_rate = acceleration_st*2^32/(16*10^6)
+inline unsigned long rate_delta(unsigned long acceleration_rate, unsigned long step_interval) {
+    return ((unsigned long long)acceleration_rate*step_interval) >> 32;
+}
+
+// Set up the block at the tail of the queue for stepper_isr()
+void st_start_block() {
+    current_block = &block_buffer[block_buffer_tail];
+    current_block->busy = true;
+    TRACE(TRACE_MOVE_START, block_buffer_tail, current_block->step_event_count);
+
+    int forward = 0, moving = 0;
+    for (int i = 0; i < NUM_AXES; i++) {
+        axis_state_t *axis = &axis_state[i];
+        axis->steps = current_block->steps_to_take[i];
+        axis->steps_remaining = axis->steps;
+        axis->counter = -(current_block->step_event_count >> 1);
+        axis->steps_skipped = 0;
+        axis->forward = current_block->direction[i];
+        if (axis->forward) forward |= 1 << i;
+        if (axis->steps) moving |= 1 << i;
     }
 
+    //Determine direction of movement
+    set_direction_pins(forward ^ axes_list::inverted_dirs, ALL_AXES & ~shaped_axes);
+
     //Only enable axis that are moving. If the axis doesn't need to move then it can stay disabled depending on configuration.
-    if (x_steps_remaining) enable_x();
-    if (y_steps_remaining) enable_y();
-    if (z_steps_remaining) enable_z();
-    if (e_steps_remaining) enable_e();
-
-    check_x_min_endstop();
-    check_y_min_endstop();
-    check_z_min_endstop();
-
-    previous_millis_heater = millis();
-
-    while (x_steps_remaining + y_steps_remaining + z_steps_remaining + e_steps_remaining > 0) { // move until no more steps remain
-        if (x_steps_remaining>0) {
-            if ((micros()-previous_micros_x) >= x_interval) {
-                do_x_step();
-                x_steps_remaining--;
+    axes_list::enable(moving);
+    axes_list::show_moving(moving);
+    axes_list::stop_at_min_endstops(axis_state);
+
+    step_events_completed = 0;
+    nominal_step_rate = current_block->nominal_rate << 4;
+    final_step_rate = current_block->final_rate << 4;
+    step_rate = current_block->initial_rate << 4;
+    step_interval = STEP_INTERVAL_SCALE/step_rate;
+}
+
+// Timer 2 match interrupt, takes one step event of the current block per interrupt.
+// The axis with the most steps sets the pace, the others follow it Bresenham style, so all
+// axes of a block stay in sync. The step rate is kept in 1/16 steps/s and the step interval in
+// 1/256 us. On every step the rate changes by acceleration*interval (a 32x32->64 bit multiply,
+// see rate_delta()) and only the new interval needs an integer divide.
+// With input shaping the interrupt also comes when the shapers have a step to take between two
+// step events, and it keeps running after the last block until the shapers are done.
+// The MR1 match of the same timer times the edges of the step pulses, see pulse_start().
+void stepper_isr() {
+    unsigned long matches = LPC_TIM2->IR;
+    LPC_TIM2->IR = matches; // clear the interrupts
+    if (matches & 2) pulse_edge();
+    if (!(matches & 1)) return;
+    TRACE(TRACE_STEP_ISR, 0, LPC_TIM2->TC);
+    step_time += LPC_TIM2->MR0; // the timer restarted from zero at the match
+
+    // The edges of the last pulses came late and they aren't over yet: come back after them. The
+    // next edge lay beyond the match and moves with the restart of the timer.
+    if (pulse_axes) {
+        if (!(matches & 2)) LPC_TIM2->MR1 = LPC_TIM2->MR1 > LPC_TIM2->MR0 ? LPC_TIM2->MR1 - LPC_TIM2->MR0 : MIN_EDGE_TICKS;
+        unsigned long ticks = pulse_end();
+        step_late_ticks += ticks;
+        LPC_TIM2->MR0 = ticks;
+        return;
+    }
+
+    bool step_event = !shaped_axes || (long)(step_time - block_step_due) >= 0;
+    if (current_block == NULL) {
+        if (!blocks_queued()) {
+            if (!shaped_axes || (!shaper_queue_used() && !shaper_behind(0) && !shaper_behind(1))) {
+                LPC_TIM2->TCR = 0; // nothing left to do, stop until st_wake_up()
+                stepper_running = false;
+                return;
             }
-            check_x_min_endstop();
-            led1 = 1;
-        } else {
-            led1 = 0;
-            wait_us(2);
+            step_event = false; // only the shapers have steps left
+        } else if (step_event) {
+            st_start_block();
         }
+    }
 
-        if (y_steps_remaining>0) {
-            if ((micros()-previous_micros_y) >= y_interval) {
-                do_y_step();
-                y_steps_remaining--;
+    int axes = 0; // axes that step this time
+    int e_advance = 0;
+    if (step_event) {
+        axes = axes_list::bresenham(axis_state, current_block->step_event_count);
+
+        // Pressure advance: keep advance_steps in proportion to the extruder speed, one step per step event
+        // at most. An extra step goes into a step event without an E step, or follows the E step as a second
+        // pulse. A step is taken back by leaving an E step out, or else by a step backwards. Moves that don't
+        // use the extruder bring the advance back to 0, the E direction is forward in all these blocks.
+        if (current_block->advance_rate || !axis_state[E_AXIS].steps) {
+            long target = ((unsigned long long)step_rate*current_block->advance_rate) >> 16;
+            if (advance_steps < target) {
+                if (axes & E_AXIS_BIT) e_advance = 1;
+                else axes |= E_AXIS_BIT;
+                advance_steps++;
+            } else if (advance_steps > target) {
+                if (axes & E_AXIS_BIT) axes &= ~E_AXIS_BIT;
+                else e_advance = -1;
+                advance_steps--;
             }
-            check_y_min_endstop();
-            led2=1;
-        } else {
-            led2=0;
-            wait_us(2);
         }
+    }
+
+    unsigned long next_impulse = 0;
+    if (shaped_axes) axes = shape_steps(axes, &next_impulse);
+
+    if (axes) {
+        unsigned long late = LPC_TIM2->TC + step_late_ticks; // the timer restarted when the step was due
+        pulse_start(axes, e_advance);
+
+        unsigned long late_us = late/STEP_TIMER_TICKS_PER_US;
+        int bucket = histogram_bucket(late_us);
+        for (int i = 0; i < 4; i++) {
+            if (axes & (1 << i)) histogram_add(&step_late[i], bucket, late_us);
+        }
+    } else if (e_advance) {
+        pulse_start(0, e_advance);
+    }
+    if (step_event) {
+        step_events_completed++;
+
+        axes_list::stop_at_min_endstops(axis_state);
+        // Endstops have stopped all axes of the block, it ends here and not after the rest of its step events
+        if (axes_list::has_min_endstops && !axes_list::steps_left(axis_state)) step_events_completed = current_block->step_event_count;
+
+        //Speed of the next step: accelerate, cruise or decelerate
+        if (step_events_completed < current_block->accelerate_until) {
+            step_rate += rate_delta(current_block->acceleration_rate, step_interval);
+            if (step_rate > nominal_step_rate) step_rate = nominal_step_rate;
+            step_interval = STEP_INTERVAL_SCALE/step_rate;
+        } else if (step_events_completed >= current_block->decelerate_after) {
+            unsigned long delta = rate_delta(current_block->acceleration_rate, step_interval);
+            if (step_rate > final_step_rate + delta) step_rate -= delta;
+            else step_rate = final_step_rate;
+            step_interval = STEP_INTERVAL_SCALE/step_rate;
+        } else if (step_rate != nominal_step_rate) {
+            step_rate = nominal_step_rate;
+            step_interval = STEP_INTERVAL_SCALE/step_rate;
+        }
+        // With input shaping the next step event is due one interval after this one was due, so the
+        // interrupts for the impulses in between don't slow the block down. A step event that is more
+        // than an interval late (after waiting for a block) counts from now instead.
+        if (!shaped_axes || (long)(step_time - block_step_due) > (long)STEP_TIMER_TICKS(step_interval)) block_step_due = step_time;
+        block_step_due += STEP_TIMER_TICKS(step_interval);
+
+        if (step_events_completed >= current_block->step_event_count) {
+            axes_list::show_moving(0);
+
+            // a shaped axis still has steps to take after its blocks
+            if (axes_list::disabled_after_move) axes_list::disable(axes_list::disabled_after_move & ~shaped_axes);
+
+            TRACE(TRACE_MOVE_END, block_buffer_tail, 0);
+            current_block = NULL;
+            block_buffer_tail = next_block_index(block_buffer_tail);
+        }
+    }
+
+    // The timer restarted from zero at the match, so the new period counts from this interrupt:
+    // the next step event, or the next impulse of the shapers if that comes first. Make sure the
+    // match still lies ahead if this interrupt took longer than the next interval, and after the
+    // pulses of this interrupt.
+    unsigned long ticks = STEP_TIMER_TICKS(step_interval);
+    if (shaped_axes) {
+        ticks = ((long)(block_step_due - step_time) > 0) ? block_step_due - step_time : 0;
+        if ((current_block == NULL && !blocks_queued()) || (next_impulse && next_impulse < ticks)) ticks = next_impulse;
+    }
+    unsigned long earliest = LPC_TIM2->TC + 2*STEP_TIMER_TICKS_PER_US;
+    if (pulse_axes && pulse_end() > earliest) earliest = pulse_end();
+    step_late_ticks = 0;
+    if (ticks <= earliest) {
+        step_late_ticks = earliest - ticks;
+        ticks = earliest;
+    }
+    LPC_TIM2->MR0 = ticks;
+}
+
+void st_init() {
+    axes_list::init();
+    LPC_SC->PCONP |= 1 << 22; // power up timer 2
+    LPC_SC->PCLKSEL1 = (LPC_SC->PCLKSEL1 & ~(3 << 12)) | (1 << 12); // PCLK_TIMER2 = CCLK
+    LPC_TIM2->TCR = 2; // stop and reset
+    LPC_TIM2->PR = STEP_TIMER_PRESCALE - 1;
+    LPC_TIM2->MCR = 3; // interrupt and reset on MR0, pulse_schedule() adds the interrupt on MR1
+    NVIC_SetVector(TIMER2_IRQn, (uint32_t)(uintptr_t)&stepper_isr);
+    NVIC_SetPriority(TIMER2_IRQn, 0); // steps take precedence over the serial port
+    NVIC_EnableIRQ(TIMER2_IRQn);
+}
+
+// Start executing the queued moves if the stepper interrupt is idle
+void st_wake_up() {
+    if (!stepper_running && blocks_queued()) {
+        stepper_running = true;
+        step_late_ticks = 0;
+        step_time = 0;
+        block_step_due = 0;
+        direction_changed = 0UL - DIRECTION_SETUP_TICKS; // long enough ago, the first interrupt is 10 us away anyway
+        pulse_fell = 0UL - STEP_PULSE_TICKS;
+        LPC_TIM2->TCR = 2;
+        LPC_TIM2->MR0 = STEP_TIMER_TICKS_PER_US*10;
+        LPC_TIM2->TCR = 1;
+    }
+}
+
+// All queued moves are done. With input shaping the motors follow the last block a little later,
+// that is waited for as well.
+bool moves_done() {
+    return !blocks_queued() && !(shaped_axes && stepper_running);
+}
 
-        if (z_steps_remaining>0) {
-            if ((micros()-previous_micros_z) >= z_interval) {
-                do_z_step();
-                z_steps_remaining--;
+// Wait until all queued moves are done, used by commands that must not overtake the motion
+void st_synchronize() {
+    st_wake_up();
+    while (!moves_done()) run_tasks();
+}
+
+// A command that waits longer than the moves in front of it (G4, M109, M190) doesn't loop until it
+// is done: once the moves are done start runs (if not NULL), and from then on loop() asks done on
+// every pass. The tasks keep running in the meantime, but the next command waits.
+void wait_for(void (*start)(), bool (*done)()) {
+    wait_start = start;
+    command_wait = done;
+    wait_moves_done = false;
+}
+
+// True while a command waits, see wait_for()
+bool command_waiting() {
+    if (!command_wait) return false;
+    if (!wait_moves_done) {
+        st_wake_up();
+        if (!moves_done()) return true;
+        wait_moves_done = true;
+        wait_started = millis();
+        if (wait_start) wait_start();
+    }
+    if (!command_wait()) return true;
+    command_wait = NULL;
+    previous_millis_cmd = millis(); // the inactivity shutdown counts from here
+    return false;
+}
+
+
+// Round a position in units (mm) to whole steps
+long units_to_steps(float units, float steps_per_unit) {
+    float steps = units*steps_per_unit;
+    return (steps >= 0) ? (long)(steps + 0.5f) : -(long)(0.5f - steps);
+}
+
+// Distance of a number of steps in micrometers, um_per_step is 16.16 fixed point
+long um_from_steps(int steps, unsigned long um_per_step) {
+    return ((unsigned long long)steps*um_per_step + 0x8000) >> 16;
+}
+
+// Refresh the fixed point copies of the steps per unit and accelerations and the constants of the
+// kinematics, after M92, M201 and M204
+void update_axis_constants() {
+    x_um_per_step = 65536000.0/x_steps_per_unit;
+    y_um_per_step = 65536000.0/y_steps_per_unit;
+    z_um_per_step = 65536000.0/z_steps_per_unit;
+    e_um_per_step = 65536000.0/e_steps_per_unit;
+    x_max_acceleration_st = x_max_acceleration*x_steps_per_unit;
+    y_max_acceleration_st = y_max_acceleration*y_steps_per_unit;
+    z_max_acceleration_st = z_max_acceleration*z_steps_per_unit;
+    e_max_acceleration_st = e_max_acceleration*e_steps_per_unit;
+    acceleration_um = acceleration*1000.0;
+    machine::update();
+}
+
+// Set up the input shapers from the settings, at startup and after M593. The step rate is limited
+// so that the step events of the longest delay fit into the shaper queue, with 1/8 of it to spare.
+void update_input_shapers() {
+    float ticks_per_second = STEP_TIMER_TICKS_PER_US*1000000.0;
+    shaper_configure(&shaper_axis[0], x_shaper_type, x_shaper_frequency, x_shaper_damping, ticks_per_second);
+    shaper_configure(&shaper_axis[1], y_shaper_type, y_shaper_frequency, y_shaper_damping, ticks_per_second);
+
+    shaper_max_rate = MAX_STEP_FREQUENCY;
+    unsigned long delay = shaper_longest_delay();
+    if (delay && SHAPER_QUEUE_SIZE*7/8*ticks_per_second/delay < shaper_max_rate) {
+        shaper_max_rate = SHAPER_QUEUE_SIZE*7/8*ticks_per_second/delay;
+    }
+
+    int axes = 0;
+    if (shaper_axis[0].impulses > 1) axes |= X_AXIS_BIT;
+    if (shaper_axis[1].impulses > 1) axes |= Y_AXIS_BIT;
+    set_direction_pins(shaped_dir_high, axes); // the pins may still be set for the last block
+    shaped_axes = axes;
+}
+
+// Set the machine position to current_* without moving, see G92 and M92
+void plan_set_position() {
+    long steps[3];
+    machine::motor_steps(current_x, current_y, current_z + mesh_correction(current_x, current_y, current_z), steps);
+    position_x = steps[0];
+    position_y = steps[1];
+    position_z = steps[2];
+    position_e = units_to_steps(current_e, e_steps_per_unit);
+}
+
+// Highest speed at the start of a distance from which target_speed can still be reached
+float max_allowable_speed(float acceleration, float target_speed, float distance) {
+    return sqrt(target_speed*target_speed + 2*acceleration*distance);
+}
+
+// Distance (in steps) after which a block that accelerates from initial_rate has to start
+// decelerating to reach final_rate at its end, used when there is no room to cruise
+float intersection_distance(float initial_rate, float final_rate, float acceleration, float distance) {
+    return (2.0*acceleration*distance - initial_rate*initial_rate + final_rate*final_rate)/(4.0*acceleration);
+}
+
+// Work out where the block accelerates, cruises and decelerates, for the given entry and exit
+// speeds in mm/s. A block that stepper_isr() has already started is left alone.
+void calculate_trapezoid_for_block(block_t *block, float entry_speed, float exit_speed) {
+    int initial_rate = ceil(block->nominal_rate*entry_speed/block->nominal_speed);
+    int final_rate = ceil(block->nominal_rate*exit_speed/block->nominal_speed);
+
+    // No step can be slower than the first one from a standstill
+    int minimal_rate = sqrt(2.0*block->acceleration_st);
+    if (minimal_rate > block->nominal_rate) minimal_rate = block->nominal_rate;
+    if (initial_rate < minimal_rate) initial_rate = minimal_rate;
+    if (final_rate < minimal_rate) final_rate = minimal_rate;
+
+    float nominal_rate = block->nominal_rate;
+    float acceleration_st = block->acceleration_st;
+    int accelerate_steps = ceil((nominal_rate*nominal_rate - (float)initial_rate*initial_rate)/(2.0*acceleration_st));
+    int decelerate_steps = floor((nominal_rate*nominal_rate - (float)final_rate*final_rate)/(2.0*acceleration_st));
+    int plateau_steps = block->step_event_count - accelerate_steps - decelerate_steps;
+
+    // Not enough room to reach the nominal rate, accelerate as far as possible and decelerate right away
+    if (plateau_steps < 0) {
+        accelerate_steps = ceil(intersection_distance(initial_rate, final_rate, acceleration_st, block->step_event_count));
+        if (accelerate_steps < 0) accelerate_steps = 0;
+        if (accelerate_steps > block->step_event_count) accelerate_steps = block->step_event_count;
+        plateau_steps = 0;
+    }
+
+    __disable_irq();
+    if (!block->busy) {
+        block->exit_speed = exit_speed;
+        block->initial_rate = initial_rate;
+        block->final_rate = final_rate;
+        block->accelerate_until = accelerate_steps;
+        block->decelerate_after = accelerate_steps + plateau_steps;
+    }
+    __enable_irq();
+}
+
+// Reverse pass: plan each entry speed so that the following block can still decelerate in time.
+// The first block is left alone, its entry speed is fixed by the move executed before it.
+void planner_reverse_pass(int first_index) {
+    int block_index = prev_block_index(block_buffer_head);
+    block_t *next = NULL;
+
+    while (block_index != first_index) {
+        block_t *current = &block_buffer[block_index];
+        if (next && current->entry_speed != current->max_entry_speed) {
+            if (!current->nominal_length_flag && current->max_entry_speed > next->entry_speed) {
+                float speed = max_allowable_speed(current->acceleration, next->entry_speed, current->millimeters);
+                current->entry_speed = (speed < current->max_entry_speed) ? speed : current->max_entry_speed;
+            } else {
+                current->entry_speed = current->max_entry_speed;
             }
-            check_z_min_endstop();
-            led3=1;
-        } else {
-            led3=0;
-            wait_us(2);
+            current->recalculate_flag = true;
         }
+        next = current;
+        block_index = prev_block_index(block_index);
+    }
+}
 
-        if (e_steps_remaining>0) {
-            if ((micros()-previous_micros_e) >= e_interval) {
-                do_e_step();
-                e_steps_remaining--;
-                led4=1;
+// Forward pass: lower the entry speeds that cannot be reached by accelerating through the previous block
+void planner_forward_pass(int first_index) {
+    int block_index = first_index;
+    block_t *previous = NULL;
+
+    while (block_index != block_buffer_head) {
+        block_t *current = &block_buffer[block_index];
+        if (previous && !previous->nominal_length_flag && previous->entry_speed < current->entry_speed) {
+            float speed = max_allowable_speed(previous->acceleration, previous->entry_speed, previous->millimeters);
+            if (speed < current->entry_speed) {
+                current->entry_speed = speed;
+                current->recalculate_flag = true;
             }
-        } else {
-            led4=0;
-            wait_us(2);
         }
+        previous = current;
+        block_index = next_block_index(block_index);
+    }
+}
 
-        if ( (millis() - previous_millis_heater) >= 500 ) {
-            manage_heater();
-            previous_millis_heater = millis();
+// Recalculate the speed profiles of the blocks whose entry or exit speed changed
+void planner_recalculate_trapezoids(int first_index) {
+    int block_index = first_index;
+    block_t *current = NULL;
 
-            manage_inactivity(2);
+    while (block_index != block_buffer_head) {
+        block_t *next = &block_buffer[block_index];
+        if (current && (current->recalculate_flag || next->recalculate_flag)) {
+            calculate_trapezoid_for_block(current, current->entry_speed, next->entry_speed);
+            current->recalculate_flag = false;
         }
+        current = next;
+        block_index = next_block_index(block_index);
+    }
+    // The last block has to come to a stop
+    calculate_trapezoid_for_block(current, current->entry_speed, MINIMUM_PLANNER_SPEED);
+    current->recalculate_flag = false;
+}
 
-        wait_us(2);
+void planner_recalculate() {
+    // Once stepper_isr() has started the block at the tail its exit speed can't change any more,
+    // so the entry speed of the block after it is fixed as well
+    int first_index = block_buffer_tail;
+    if (block_buffer[first_index].busy && next_block_index(first_index) != block_buffer_head) {
+        block_t *next = &block_buffer[next_block_index(first_index)];
+        if (next->entry_speed != block_buffer[first_index].exit_speed) {
+            next->entry_speed = block_buffer[first_index].exit_speed;
+            next->recalculate_flag = true;
+        }
+        first_index = next_block_index(first_index);
     }
 
-    led1=0;
-    led2=0;
-    led3=0;
-    led4=0;
+    planner_reverse_pass(first_index);
+    planner_forward_pass(first_index);
+    planner_recalculate_trapezoids(first_index);
+}
 
-    if (DISABLE_X) disable_x();
-    if (DISABLE_Y) disable_y();
-    if (DISABLE_Z) disable_z();
-    if (DISABLE_E) disable_e();
+// Queue a linear move from current_* to destination_* at feedrate, see G0 and G1.
+// If the queue is full this waits until stepper_isr() has finished the oldest move.
+void plan_buffer_line() {
+    while (next_block_index(block_buffer_head) == block_buffer_tail) {
+        st_wake_up();
+        run_tasks();
+    }
 
-    // Update current position partly based on direction, we probably can combine this with the direction code above...
-    if (destination_x > current_x) current_x = current_x + x_steps_to_take/x_steps_per_unit;
-    else current_x = current_x - x_steps_to_take/x_steps_per_unit;
-    if (destination_y > current_y) current_y = current_y + y_steps_to_take/y_steps_per_unit;
-    else current_y = current_y - y_steps_to_take/y_steps_per_unit;
-    if (destination_z > current_z) current_z = current_z + z_steps_to_take/z_steps_per_unit;
-    else current_z = current_z - z_steps_to_take/z_steps_per_unit;
-    if (destination_e > current_e) current_e = current_e + e_steps_to_take/e_steps_per_unit;
-    else current_e = current_e - e_steps_to_take/e_steps_per_unit;
+    // Targets are converted to motor steps once, the move itself is planned in steps
+    long target[3];
+    machine::motor_steps(destination_x, destination_y, destination_z + destination_mesh_z, target);
+    long target_x = target[0];
+    long target_y = target[1];
+    long target_z = target[2];
+    long target_e = units_to_steps(destination_e, e_steps_per_unit);
+    bool dir_x = (target_x >= position_x);
+    bool dir_y = (target_y >= position_y);
+    bool dir_z = (target_z >= position_z);
+    bool dir_e = (target_e >= position_e);
+    int x_steps_to_take = dir_x ? target_x - position_x : position_x - target_x;
+    int y_steps_to_take = dir_y ? target_y - position_y : position_y - target_y;
+    int z_steps_to_take = dir_z ? target_z - position_z : position_z - target_z;
+    int e_steps_to_take = dir_e ? target_e - position_e : position_e - target_e;
+
+    int step_event_count = max(max(x_steps_to_take, y_steps_to_take), max(z_steps_to_take, e_steps_to_take));
+    if (step_event_count == 0) {
+        // Less than half a step on every axis: nothing is queued but the coordinates still move on.
+        // position_* keeps the old step counts, so the next target includes what was rounded away.
+        current_x = destination_x;
+        current_y = destination_y;
+        current_z = destination_z;
+        current_e = destination_e;
+        return;
+    }
+
+    // Distance of each axis in micrometers
+    long delta_x = um_from_steps(x_steps_to_take, x_um_per_step);
+    long delta_y = um_from_steps(y_steps_to_take, y_um_per_step);
+    long delta_z = um_from_steps(z_steps_to_take, z_um_per_step);
+    long delta_e = um_from_steps(e_steps_to_take, e_um_per_step);
+
+    // Direction and length of the move in micrometers. With Cartesian kinematics they come from the
+    // steps, otherwise the motors don't move along X, Y and Z and they come from the coordinates.
+    float move_x = dir_x ? delta_x : -delta_x;
+    float move_y = dir_y ? delta_y : -delta_y;
+    float move_z = dir_z ? delta_z : -delta_z;
+    if (!machine::cartesian) {
+        move_x = (destination_x - current_x)*1000.0;
+        move_y = (destination_y - current_y)*1000.0;
+        move_z = (destination_z - current_z)*1000.0;
+    }
+    float length = sqrt(move_x*move_x + move_y*move_y + move_z*move_z);
+    if (length == 0.0) length = delta_e; // extruder only move
+    if (length == 0.0) length = 1;
+
+    // The feedrate applies to the axis that travels furthest, so the leading axis steps at
+    // step_event_count * feedrate / longest axis distance. Without Cartesian kinematics it
+    // applies to the path.
+    long max_delta = machine::cartesian ? max(max(delta_x, delta_y), max(delta_z, delta_e)) : (long)length;
+    if (max_delta == 0) max_delta = 1;
+    unsigned long feedrate_um = feedrate*(1000.0/60.0); // um/s
+    unsigned long nominal_rate = ((unsigned long long)step_event_count*feedrate_um + max_delta - 1)/max_delta;
+    if (nominal_rate < 1) nominal_rate = 1;
+
+    if (DEBUGGING) {
+        pc.printf("destination_x: %f\n",destination_x);
+        pc.printf("position_x: %d\n",position_x);
+        pc.printf("x_steps_to_take: %d\n\n",x_steps_to_take);
+
+        pc.printf("destination_y: %f\n",destination_y);
+        pc.printf("position_y: %d\n",position_y);
+        pc.printf("y_steps_to_take: %d\n\n",y_steps_to_take);
+
+        pc.printf("destination_z: %f\n",destination_z);
+        pc.printf("position_z: %d\n",position_z);
+        pc.printf("z_steps_to_take: %d\n\n",z_steps_to_take);
+
+        pc.printf("destination_e: %f\n",destination_e);
+        pc.printf("position_e: %d\n",position_e);
+        pc.printf("e_steps_to_take: %d\n\n",e_steps_to_take);
+
+        pc.printf("nominal_rate: %d\n\n",nominal_rate);
+    }
+
+    block_t *block = &block_buffer[block_buffer_head];
+    block->steps_to_take[X_AXIS] = x_steps_to_take;
+    block->steps_to_take[Y_AXIS] = y_steps_to_take;
+    block->steps_to_take[Z_AXIS] = z_steps_to_take;
+    block->steps_to_take[E_AXIS] = e_steps_to_take;
+    block->step_event_count = step_event_count;
+    block->direction[X_AXIS] = dir_x;
+    block->direction[Y_AXIS] = dir_y;
+    block->direction[Z_AXIS] = dir_z;
+    block->direction[E_AXIS] = dir_e;
+    for (int i = E_AXIS + 1; i < NUM_AXES; i++) { // axes the moves don't drive yet, e.g. a second extruder
+        block->steps_to_take[i] = 0;
+        block->direction[i] = true;
+    }
+
+    block->millimeters = length*0.001;
+    if (nominal_rate > MAX_STEP_FREQUENCY) nominal_rate = MAX_STEP_FREQUENCY;
+    if (nominal_rate > shaper_max_rate && (x_steps_to_take || y_steps_to_take)) nominal_rate = shaper_max_rate;
+    block->nominal_rate = nominal_rate;
+    block->nominal_speed = block->millimeters*nominal_rate/step_event_count;
+
+    // Acceleration along the path in steps/s^2 of the leading axis, limited so that no axis
+    // exceeds its own maximum acceleration
+    unsigned long acceleration_st = (unsigned long long)acceleration_um*step_event_count/(unsigned long)length;
+    if ((unsigned long long)acceleration_st*x_steps_to_take > (unsigned long long)x_max_acceleration_st*step_event_count)
+        acceleration_st = (unsigned long long)x_max_acceleration_st*step_event_count/x_steps_to_take;
+    if ((unsigned long long)acceleration_st*y_steps_to_take > (unsigned long long)y_max_acceleration_st*step_event_count)
+        acceleration_st = (unsigned long long)y_max_acceleration_st*step_event_count/y_steps_to_take;
+    if ((unsigned long long)acceleration_st*z_steps_to_take > (unsigned long long)z_max_acceleration_st*step_event_count)
+        acceleration_st = (unsigned long long)z_max_acceleration_st*step_event_count/z_steps_to_take;
+    if ((unsigned long long)acceleration_st*e_steps_to_take > (unsigned long long)e_max_acceleration_st*step_event_count)
+        acceleration_st = (unsigned long long)e_max_acceleration_st*step_event_count/e_steps_to_take;
+    if (acceleration_st < 1) acceleration_st = 1;
+    block->acceleration_st = acceleration_st;
+    block->acceleration_rate = ((unsigned long long)acceleration_st*ACCELERATION_RATE_SCALE) >> 16;
+    block->acceleration = block->millimeters*acceleration_st/step_event_count;
+
+    // Pressure advance for moves that extrude while the nozzle moves. Retracts and travel moves leave
+    // the advance as it is, the next extruding move takes it back. step_rate is in 1/16 steps/s.
+    block->advance_rate = 0;
+    if (advance_k > 0 && e_steps_to_take && dir_e && (x_steps_to_take || y_steps_to_take)) {
+        block->advance_rate = advance_k*e_steps_to_take*4096.0/step_event_count;
+    }
+
+    // Junction speed limit, from the angle between this move and the previous one:
+    // the corner is treated as an arc of radius r that deviates junction_deviation from the path
+    // and is taken at the speed where the centripetal acceleration equals acceleration.
+    float unit_x = move_x/length;
+    float unit_y = move_y/length;
+    float unit_z = move_z/length;
+    float vmax_junction = MINIMUM_PLANNER_SPEED;
+    if (blocks_queued() && previous_nominal_speed > 0.0) {
+        float cos_theta = -previous_unit_x*unit_x - previous_unit_y*unit_y - previous_unit_z*unit_z;
+        if (cos_theta < 0.95) {
+            vmax_junction = (block->nominal_speed < previous_nominal_speed) ? block->nominal_speed : previous_nominal_speed;
+            if (cos_theta > -0.95) {
+                float sin_theta_d2 = sqrt(0.5*(1.0 - cos_theta));
+                float v = sqrt(block->acceleration*junction_deviation*sin_theta_d2/(1.0 - sin_theta_d2));
+                if (v < vmax_junction) vmax_junction = v;
+            }
+        }
+    }
+    block->max_entry_speed = vmax_junction;
+    block->entry_speed = max_allowable_speed(block->acceleration, MINIMUM_PLANNER_SPEED, block->millimeters);
+    if (block->entry_speed > vmax_junction) block->entry_speed = vmax_junction;
+    block->exit_speed = MINIMUM_PLANNER_SPEED;
+    block->nominal_length_flag = (block->nominal_speed <= max_allowable_speed(block->acceleration, MINIMUM_PLANNER_SPEED, block->millimeters));
+    block->recalculate_flag = true;
+    block->busy = false;
+
+    previous_unit_x = unit_x;
+    previous_unit_y = unit_y;
+    previous_unit_z = unit_z;
+    previous_nominal_speed = block->nominal_speed;
+
+    // The machine position is kept in whole steps, so rounding never adds up between moves
+    position_x = target_x;
+    position_y = target_y;
+    position_z = target_z;
+    position_e = target_e;
+    current_x = destination_x;
+    current_y = destination_y;
+    current_z = destination_z;
+    current_e = destination_e;
+
+    block_buffer_head = next_block_index(block_buffer_head);
+    previous_millis_planner = millis();
+
+    planner_recalculate();
 }
 
+// Queue the move from current_* to destination_* split at the grid lines of the bed mesh, see BedMesh.h.
+// Within a cell the move is planned straight from where it enters to where it leaves, with the
+// correction of these points. The fraction of the move at which the next grid line of a column or row
+// comes grows by a fixed step, and the correction at a crossing is interpolated along that one line.
+void mesh_move() {
+    float start_x = current_x, start_y = current_y, start_z = current_z, start_e = current_e;
+    float target_x = destination_x, target_y = destination_y, target_z = destination_z, target_e = destination_e;
+    float dx = target_x - start_x, dy = target_y - start_y, dz = target_z - start_z, de = target_e - start_e;
+
+    int cell_x = mesh_cell_x(start_x), end_cell_x = mesh_cell_x(target_x);
+    int cell_y = mesh_cell_y(start_y), end_cell_y = mesh_cell_y(target_y);
+    int step_x = (end_cell_x > cell_x) ? 1 : -1;
+    int step_y = (end_cell_y > cell_y) ? 1 : -1;
+    float t_x = 0, t_y = 0, dt_x = 0, dt_y = 0; // fraction of the move at the next grid line, and between two
+    if (cell_x != end_cell_x) {
+        t_x = (mesh_point_x(step_x > 0 ? cell_x + 1 : cell_x) - start_x)/dx;
+        dt_x = mesh_spacing_x()/fabs(dx);
+    }
+    if (cell_y != end_cell_y) {
+        t_y = (mesh_point_y(step_y > 0 ? cell_y + 1 : cell_y) - start_y)/dy;
+        dt_y = mesh_spacing_y()/fabs(dy);
+    }
 
+    while (cell_x != end_cell_x || cell_y != end_cell_y) {
+        float t, z;
+        if (cell_x != end_cell_x && (cell_y == end_cell_y || t_x <= t_y)) {
+            t = t_x;
+            z = mesh_column_z(step_x > 0 ? cell_x + 1 : cell_x, start_y + dy*t);
+            cell_x += step_x;
+            t_x += dt_x;
+        } else {
+            t = t_y;
+            z = mesh_row_z(step_y > 0 ? cell_y + 1 : cell_y, start_x + dx*t);
+            cell_y += step_y;
+            t_y += dt_y;
+        }
+        destination_x = start_x + dx*t;
+        destination_y = start_y + dy*t;
+        destination_z = start_z + dz*t;
+        destination_e = start_e + de*t;
+        destination_mesh_z = z*mesh_fade(destination_z);
+        plan_buffer_line();
+    }
+    destination_x = target_x;
+    destination_y = target_y;
+    destination_z = target_z;
+    destination_e = target_e;
+    destination_mesh_z = mesh_correction(target_x, target_y, target_z);
+    plan_buffer_line();
+}
+
+// Queue the move from current_* to destination_*. Kinematics that don't move in straight lines
+// get it as segments of 1/delta_segments_per_second seconds at the feedrate, plan_buffer_line()
+// takes the end of each one to the motors. Below mesh_fade_height the bed mesh corrects the moves.
+void prepare_move() {
+    if (!machine::segmented) {
+        if (mesh_fade(current_z) || mesh_fade(destination_z)) {
+            mesh_move();
+            return;
+        }
+        destination_mesh_z = 0;
+        plan_buffer_line();
+        return;
+    }
+
+    float start_x = current_x, start_y = current_y, start_z = current_z, start_e = current_e;
+    float target_x = destination_x, target_y = destination_y, target_z = destination_z, target_e = destination_e;
+    float dx = target_x - start_x, dy = target_y - start_y, dz = target_z - start_z;
+    float seconds = sqrt(dx*dx + dy*dy + dz*dz)/(feedrate/60.0);
+    int segments = ceil(seconds*delta_segments_per_second);
+    if (segments < 1) segments = 1;
+
+    for (int i = 1; i < segments; i++) {
+        float fraction = (float)i/segments;
+        destination_x = start_x + dx*fraction;
+        destination_y = start_y + dy*fraction;
+        destination_z = start_z + dz*fraction;
+        destination_e = start_e + (target_e - start_e)*fraction;
+        destination_mesh_z = mesh_correction(destination_x, destination_y, destination_z);
+        plan_buffer_line();
+    }
+    destination_x = target_x;
+    destination_y = target_y;
+    destination_z = target_z;
+    destination_e = target_e;
+    destination_mesh_z = mesh_correction(target_x, target_y, target_z);
+    plan_buffer_line();
+}
 
 
 void ClearToSend() {
     previous_millis_cmd = millis();
     pc.printf("ok\n");
+    TRACE(TRACE_OK_SENT, 0, 0);
 }
 
 
@@ -616,23 +1438,104 @@ void FlushSerialRequestResend() {
 }
 
 
-//#define code_num (strtod(&cmdbuffer[strchr_pointer - cmdbuffer + 1], NULL))
-//inline void code_search(char code) { strchr_pointer = strchr(cmdbuffer, code); }
+// Powers of ten for parse_number(), a decimal number is read as an integer and scaled once
+const float pow10_table[] = {1.0, 10.0, 100.0, 1000.0, 10000.0, 100000.0, 1000000.0, 10000000.0, 100000000.0, 1000000000.0};
+
+// Read a number like "-12.345" at p without strtod(). Returns a pointer behind the number.
+const char *parse_number(const char *p, float *value) {
+    bool negative = false;
+    bool fraction = false;
+    unsigned long mantissa = 0;
+    int decimals = 0; // digits behind the point that went into mantissa
+    int exponent = 0; // integer digits that didn't fit into mantissa
+
+    if (*p == '-' || *p == '+') negative = (*p++ == '-');
+    for (;; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (mantissa < 100000000UL) {
+                mantissa = mantissa*10 + (*p - '0');
+                if (fraction) decimals++;
+            } else if (!fraction) {
+                exponent++;
+            }
+        } else if (*p == '.' && !fraction) {
+            fraction = true;
+        } else {
+            break;
+        }
+    }
+
+    float result = (float)mantissa;
+    if (decimals) result /= pow10_table[decimals];
+    while (exponent > 9) {
+        result *= pow10_table[9];
+        exponent -= 9;
+    }
+    if (exponent) result *= pow10_table[exponent];
+    *value = negative ? -result : result;
+    return p;
+}
+
+// Split a line into its words in a single pass and compute the checksum on the way.
+// The first occurrence of a letter wins, like the strchr() search it replaces.
+void parse_command(const char *line, command_t *cmd) {
+    const char *p = line;
+    int checksum = 0;
+    float number;
+    bool text = false; // the rest of the line is a file name, only the checksum is wanted
+
+    cmd->seen = 0;
+    cmd->line_number = 0;
+    cmd->has_checksum = false;
+    cmd->checksum_received = 0;
+
+    while (*p) {
+        char c = *p;
+        if (c == '*') {
+            p = parse_number(p + 1, &number);
+            cmd->has_checksum = true;
+            cmd->checksum_received = (int)number;
+            break;
+        }
+        checksum ^= c;
+        p++;
+        if (c >= 'A' && c <= 'Z' && !text) {
+            unsigned long bit = 1UL << (c - 'A');
+            const char *start = p;
+            const char *end = parse_number(p, &number);
+            for (; p < end; p++) checksum ^= *p;
+            if (!(cmd->seen & bit)) {
+                cmd->seen |= bit;
+                cmd->value[c - 'A'] = number;
+                if (c == 'N') cmd->line_number = strtol(start, NULL, 10); // exact, a float has only 24 bits
+                if (c == 'M' && (int)number == 23) text = true;
+            }
+        }
+    }
+    cmd->checksum = checksum;
+}
+
+// True if cmd is the G or M code number
+bool command_is(const command_t *cmd, char letter, int number) {
+    return (cmd->seen & (1UL << (letter - 'A'))) && (int)cmd->value[letter - 'A'] == number;
+}
+
 float code_value() {
-    return (strtod(&cmdbuffer[strchr_pointer - cmdbuffer + 1], NULL));
+    if (!(command->seen & (1UL << code_letter))) return 0.0;
+    return command->value[code_letter];
 }
 
 long code_value_long() {
-    return (strtol(&cmdbuffer[strchr_pointer - cmdbuffer + 1], NULL, 10));
+    return (long)code_value();
 }
 
 bool code_seen(char code_string[]) {
-    return (strstr(cmdbuffer, code_string) != NULL);    //Return True if the string was found
+    return (strstr(cmdbuffer[bufindr], code_string) != NULL);    //Return True if the string was found
 }
 
 bool code_seen(char code) {
-    strchr_pointer = strchr(cmdbuffer, code);
-    return (strchr_pointer != NULL);  //Return True if a character was found
+    code_letter = code - 'A';
+    return (command->seen & (1UL << code_letter)) != 0;  //Return True if the letter was in the command
 }
 
 void get_coordinates() {
@@ -649,16 +1552,6 @@ void get_coordinates() {
         if (next_feedrate > 0.0) feedrate = next_feedrate;
     }
 
-    //Find direction
-    if (destination_x >= current_x) direction_x=1;
-    else direction_x=0;
-    if (destination_y >= current_y) direction_y=1;
-    else direction_y=0;
-    if (destination_z >= current_z) direction_z=1;
-    else direction_z=0;
-    if (destination_e >= current_e) direction_e=1;
-    else direction_e=0;
-
 
     if (min_software_endstops) {
         if (destination_x < 0) destination_x = 0.0;
@@ -675,289 +1568,1011 @@ void get_coordinates() {
     if (feedrate > max_feedrate) feedrate = max_feedrate;
 }
 
-void process_commands() {
-    unsigned long codenum; //throw away variable
-
-    if (code_seen('N')) {
-        gcode_N = code_value_long();
-        if (gcode_N != gcode_LastN+1 && (strstr(cmdbuffer, "M110") == NULL) ) {
+// Check the line number and checksum of a received line before it is queued.
+// Returns false if the line has to be dropped.
+bool check_line(const command_t *cmd) {
+    if (cmd->seen & (1UL << ('N' - 'A'))) {
+        gcode_N = cmd->line_number;
+        if (gcode_N != gcode_LastN+1 && !command_is(cmd, 'M', 110) ) {
             gcode_LastN=0;
             pc.printf("ok");
-            //if(gcode_N != gcode_LastN+1 && !code_seen("M110") ) {   //Hmm, compile size is different between using this vs the line above even though it should be the same thing. Keeping old method.
             //pc.printf("Serial Error: Line Number is not Last Line Number+1, Last Line:");
             //pc.printf("%d\n",gcode_LastN);
             //FlushSerialRequestResend();
-            return;
+            return false;
         }
 
-        if (code_seen('*')) {
-            int checksum = 0;
-            int count=0;
-            while (cmdbuffer[count] != '*') checksum = checksum^cmdbuffer[count++];
-
-            if ( (int)code_value() != checksum) {
+        if (cmd->has_checksum) {
+            if (cmd->checksum_received != cmd->checksum) {
                 //pc.printf("Error: checksum mismatch, Last Line:");
                 //pc.printf("%d\n",gcode_LastN);
                 //FlushSerialRequestResend();
-                return;
+                return false;
             }
             //if no errors, continue parsing
         } else {
             //pc.printf("Error: No Checksum with line number, Last Line:");
             //pc.printf("%d\n",gcode_LastN);
             //FlushSerialRequestResend();
-            return;
+            return false;
         }
 
         gcode_LastN = gcode_N;
         //if no errors, continue parsing
     } else { // if we don't receive 'N' but still see '*'
-        if (code_seen('*')) {
+        if (cmd->has_checksum) {
             //pc.printf("Error: No Line Number with checksum, Last Line:");
             //pc.printf("%d\n",gcode_LastN);
-            return;
+            return false;
         }
     }
 
     //continues parsing only if we don't receive any 'N' or '*' or no errors if we do. :)
+    return true;
+}
 
-    if (code_seen('G')) {
-        switch ((int)code_value()) {
-            case 0: // G0 -> G1
-            case 1: // G1
-                reset_timers();//avoid timer overflow after 30 seconds
-                get_coordinates(); // For X Y Z E F
-                x_steps_to_take = abs(destination_x - current_x)*x_steps_per_unit;
-                y_steps_to_take = abs(destination_y - current_y)*y_steps_per_unit;
-                z_steps_to_take = abs(destination_z - current_z)*z_steps_per_unit;
-                e_steps_to_take = abs(destination_e - current_e)*e_steps_per_unit;
-                //printf(" x_steps_to_take:%d\n", x_steps_to_take);
-
-
-                time_for_move = max(X_TIME_FOR_MOVE,Y_TIME_FOR_MOVE);
-                time_for_move = max(time_for_move,Z_TIME_FOR_MOVE);
-                time_for_move = max(time_for_move,E_TIME_FOR_MOVE);
-
-                if (x_steps_to_take) x_interval = time_for_move/x_steps_to_take;
-                if (y_steps_to_take) y_interval = time_for_move/y_steps_to_take;
-                if (z_steps_to_take) z_interval = time_for_move/z_steps_to_take;
-                if (e_steps_to_take) e_interval = time_for_move/e_steps_to_take;
-
-
-                x_steps_remaining = x_steps_to_take;
-                y_steps_remaining = y_steps_to_take;
-                z_steps_remaining = z_steps_to_take;
-                e_steps_remaining = e_steps_to_take;
-
-
-                if (DEBUGGING) {
-                    pc.printf("destination_x: %f\n",destination_x);
-                    pc.printf("current_x: %f\n",current_x);
-                    pc.printf("x_steps_to_take: %d\n",x_steps_to_take);
-                    pc.printf("X_TIME_FOR_MOVE: %f\n",X_TIME_FOR_MOVE);
-                    pc.printf("x_interval: %f\n\n",x_interval);
-
-                    pc.printf("destination_y: %f\n",destination_y);
-                    pc.printf("current_y: %f\n",current_y);
-                    pc.printf("y_steps_to_take: %d\n",y_steps_to_take);
-                    pc.printf("Y_TIME_FOR_MOVE: %f\n",Y_TIME_FOR_MOVE);
-                    pc.printf("y_interval: %f\n\n",y_interval);
-
-                    pc.printf("destination_z: %f\n",destination_z);
-                    pc.printf("current_z: %f\n",current_z);
-                    pc.printf("z_steps_to_take: %d\n",z_steps_to_take);
-                    pc.printf("Z_TIME_FOR_MOVE: %f\n",Z_TIME_FOR_MOVE);
-                    pc.printf("z_interval: %f\n\n",z_interval);
-
-                    pc.printf("destination_e: %f\n",destination_e);
-                    pc.printf("current_e: %f\n",current_e);
-                    pc.printf("e_steps_to_take: %d\n",e_steps_to_take);
-                    pc.printf("E_TIME_FOR_MOVE: %f\n",E_TIME_FOR_MOVE);
-                    pc.printf("e_interval: %f\n\n",e_interval);
-                }
+// Read the next block of the print file into file_block[block]
+void file_read_block(int block) {
+    file_block_length[block] = fread(file_block[block], 1, FILE_BLOCK_SIZE, print_file);
+}
+
+// Start reading the file from position again, after opening it or M26
+void file_seek(long position) {
+    fseek(print_file, position, SEEK_SET);
+    file_position = position;
+    file_block_length[0] = file_block_length[1] = 0;
+    file_block_read = 0;
+    file_block_pos = 0;
+}
+
+// Fill the block that isn't being parsed, so the next line is already in memory when it is needed
+void file_read_ahead() {
+    int block = file_block_read ^ 1;
+    if (print_file && !file_block_length[block] && !feof(print_file)) {
+        file_read_block(block);
+    }
+}
+
+// Continue with the other block once the current one is used up, returns false at the end of the file
+bool file_next_block() {
+    file_block_length[file_block_read] = 0;
+    file_block_read ^= 1;
+    file_block_pos = 0;
+    if (!file_block_length[file_block_read]) file_read_block(file_block_read); // the read ahead didn't keep up
+    return file_block_length[file_block_read] > 0;
+}
+
+void file_close() {
+    if (print_file) fclose(print_file);
+    print_file = NULL;
+    if (file_printing) file_time += micros64() - file_time_started;
+    file_printing = false;
+}
 
-                linear_move(); // make the move
-                ClearToSend();
+// G and M code handlers, looked up in gcode_table and mcode_table by process_commands()
+
+void gcode_G1() { // G0 -> G1
+    get_coordinates(); // For X Y Z E F
+    prepare_move(); // queue the move
+}
+
+// Queue a G2/G3 arc as straight segments. The end points of the segments are found by rotating the
+// radius vector by a fixed angle each time, with small angle approximations of sin and cos, and an
+// exact sin/cos every ARC_CORRECTION_SEGMENTS segments to keep the rounding errors from adding up.
+void arc_move(bool clockwise) {
+    float start_x = current_x, start_y = current_y, start_z = current_z, start_e = current_e;
+    float offset_x = 0.0, offset_y = 0.0; // center relative to the start
+
+    get_coordinates(); // For X Y Z E F
+    float target_x = destination_x, target_y = destination_y, target_z = destination_z, target_e = destination_e;
+
+    if (code_seen('R')) {
+        // Center on the perpendicular bisector of the chord, on the far side for R < 0 (arc over 180 degrees).
+        // If R is too small to reach the end point, the center is the middle of the chord.
+        float radius = code_value();
+        float dx = target_x - start_x, dy = target_y - start_y;
+        float half_chord = 0.5*sqrt(dx*dx + dy*dy);
+        if (half_chord == 0.0) return;
+        float h2 = (fabs(radius) - half_chord)*(fabs(radius) + half_chord);
+        float h = (h2 > 0.0) ? sqrt(h2)/half_chord : 0.0;
+        if (clockwise != (radius < 0)) h = -h;
+        offset_x = 0.5*(dx - h*dy);
+        offset_y = 0.5*(dy + h*dx);
+    } else {
+        if (code_seen('I')) offset_x = code_value();
+        if (code_seen('J')) offset_y = code_value();
+    }
+
+    float center_x = start_x + offset_x, center_y = start_y + offset_y;
+    float radius = sqrt(offset_x*offset_x + offset_y*offset_y);
+    if (radius == 0.0) {
+        prepare_move();
+        return;
+    }
+    float r_x = -offset_x, r_y = -offset_y; // radius vector to the current point
+    float rt_x = target_x - center_x, rt_y = target_y - center_y;
+
+    // Angle between start and end, a full circle if they are the same
+    float angular_travel = atan2(r_x*rt_y - r_y*rt_x, r_x*rt_x + r_y*rt_y);
+    if (clockwise) {
+        if (angular_travel >= -ARC_ANGLE_EPSILON) angular_travel -= 2*PI;
+    } else {
+        if (angular_travel <= ARC_ANGLE_EPSILON) angular_travel += 2*PI;
+    }
+
+    // A chord of angle theta is r*(1 - cos(theta/2)) away from the arc
+    float cos_half_theta = 1.0 - arc_tolerance/radius;
+    if (cos_half_theta < 0.70710678) cos_half_theta = 0.70710678; // at most 90 degrees per segment
+    int segments = ceil(fabs(angular_travel)/(2*acos(cos_half_theta)));
+    if (segments < 1) segments = 1;
+
+    float theta_per_segment = angular_travel/segments;
+    float z_per_segment = (target_z - start_z)/segments;
+    float e_per_segment = (target_e - start_e)/segments;
+
+    // Third order approximations of cos and sin of theta_per_segment
+    float cos_t = 2.0 - theta_per_segment*theta_per_segment;
+    float sin_t = theta_per_segment*0.16666667*(cos_t + 4.0);
+    cos_t *= 0.5;
+
+    for (int i = 1; i < segments; i++) {
+        if (i % ARC_CORRECTION_SEGMENTS) {
+            float r_new = r_x*sin_t + r_y*cos_t;
+            r_x = r_x*cos_t - r_y*sin_t;
+            r_y = r_new;
+        } else {
+            float angle = i*theta_per_segment;
+            float cos_i = cos(angle), sin_i = sin(angle);
+            r_x = -offset_x*cos_i + offset_y*sin_i;
+            r_y = -offset_x*sin_i - offset_y*cos_i;
+        }
+        destination_x = center_x + r_x;
+        destination_y = center_y + r_y;
+        destination_z = start_z + i*z_per_segment;
+        destination_e = start_e + i*e_per_segment;
+        prepare_move();
+    }
+
+    destination_x = target_x;
+    destination_y = target_y;
+    destination_z = target_z;
+    destination_e = target_e;
+    prepare_move();
+}
+
+void gcode_G2() {
+    arc_move(true);
+}
+
+void gcode_G3() {
+    arc_move(false);
+}
+
+bool dwell_over() {
+    return millis() - wait_started >= dwell_time;
+}
+
+void gcode_G4() { // G4 dwell
+    dwell_time = 0;
+    if (code_seen('P')) dwell_time = code_value(); // milliseconds to wait
+    if (code_seen('S')) dwell_time = code_value()*1000; // seconds to wait
+    wait_for(NULL, dwell_over);
+}
+
+// Queue a move to x, y, z at feedrate, E stays
+void move_to(float x, float y, float z) {
+    destination_x = x;
+    destination_y = y;
+    destination_z = z;
+    destination_e = current_e;
+    prepare_move();
+}
+
+// Move Z down at mesh_probe_feedrate until the Z min endstop triggers, at most to -mesh_probe_height.
+// stepper_isr() stops Z at the endstop, the steps it left out give the height. Returns false if the
+// endstop didn't trigger.
+bool probe_bed(float *z) {
+    feedrate = mesh_probe_feedrate;
+    move_to(current_x, current_y, -mesh_probe_height);
+    st_synchronize();
+    if (!z_axis::min_endstop_hit()) return false;
+    current_z = destination_z + axis_state[Z_AXIS].steps_skipped/z_steps_per_unit;
+    plan_set_position();
+    *z = current_z;
+    return true;
+}
+
+// Height of the nozzle without the bed mesh correction
+float uncorrected_z() {
+    return current_z + mesh_correction(current_x, current_y, current_z);
+}
+
+// After the mesh settings changed, without moving: Z becomes what the nozzle at uncorrected height z
+// has with the new correction
+void set_uncorrected_z(float z) {
+    current_z = mesh_z_for_height(current_x, current_y, z);
+    plan_set_position();
+}
+
+void print_mesh() {
+    pc.printf(" mesh:%s fade:%f\n", mesh_enabled ? "on" : (mesh_valid ? "off" : "none"), mesh_fade_height);
+    for (int iy = MESH_POINTS_Y - 1; mesh_valid && iy >= 0; iy--) { // back row first, as seen from the front
+        pc.printf(" Y%f:", mesh_point_y(iy));
+        for (int ix = 0; ix < MESH_POINTS_X; ix++) pc.printf(" %f", mesh_z[iy][ix]);
+        pc.printf("\n");
+    }
+}
+
+void gcode_G29() { // G29 - probe the bed mesh
+    if (!z_axis::has_min_endstop || KINEMATICS == KINEMATICS_DELTA) {
+        pc.printf("G29 needs a Z min endstop on the Z motor\n");
+        return;
+    }
+    st_synchronize();
+    float z = uncorrected_z();
+    mesh_valid = mesh_enabled = false;
+    set_uncorrected_z(z);
+
+    float saved_feedrate = feedrate;
+    for (int iy = 0; iy < MESH_POINTS_Y; iy++) {
+        for (int i = 0; i < MESH_POINTS_X; i++) {
+            int ix = (iy & 1) ? MESH_POINTS_X - 1 - i : i; // back and forth
+            feedrate = mesh_travel_feedrate;
+            move_to(current_x, current_y, mesh_probe_height);
+            move_to(mesh_point_x(ix), mesh_point_y(iy), mesh_probe_height);
+            if (!probe_bed(&mesh_z[iy][ix])) {
+                feedrate = saved_feedrate;
+                pc.printf("G29 failed, no endstop at X%f Y%f\n", current_x, current_y);
                 return;
-            case 4: // G4 dwell
-                codenum = 0;
-                if (code_seen('P')) codenum = code_value(); // milliseconds to wait
-                if (code_seen('S')) codenum = code_value()*1000; // seconds to wait
-                previous_millis_heater = millis();  // keep track of when we started waiting
-                while ((millis() - previous_millis_heater) < codenum ) manage_heater(); //manage heater until time is up
-                break;
-            case 90: // G90
-                relative_mode = false;
-                break;
-            case 91: // G91
-                relative_mode = true;
-                break;
-            case 92: // G92
-                if (code_seen('X')) current_x = code_value();
-                if (code_seen('Y')) current_y = code_value();
-                if (code_seen('Z')) current_z = code_value();
-                if (code_seen('E')) current_e = code_value();
-                break;
-           case 93: // G93
-                pc.printf("previous_micros:%d\n", previous_micros);
-                pc.printf("previous_micros_x:%d\n", previous_micros_x);
-                pc.printf("previous_micros_y:%d\n", previous_micros_y);
-                pc.printf("previous_micros_z:%d\n", previous_micros_z);
-                break;
+            }
+        }
+    }
+    // The heights are relative to the first point, which becomes Z0
+    float z0 = mesh_z[0][0];
+    for (int iy = 0; iy < MESH_POINTS_Y; iy++) {
+        for (int ix = 0; ix < MESH_POINTS_X; ix++) mesh_z[iy][ix] -= z0;
+    }
+    mesh_valid = mesh_enabled = true;
+    set_uncorrected_z(current_z - z0);
+    feedrate = mesh_travel_feedrate;
+    move_to(current_x, current_y, mesh_probe_height);
+    feedrate = saved_feedrate;
+
+    if (!mesh_save()) pc.printf("mesh not saved, File: %s\n", MESH_FILE);
+    print_mesh();
+}
+
+void gcode_G90() {
+    relative_mode = false;
+}
+
+void gcode_G91() {
+    relative_mode = true;
+}
+
+void gcode_G92() {
+    st_synchronize();
+    if (code_seen('X')) current_x = code_value();
+    if (code_seen('Y')) current_y = code_value();
+    if (code_seen('Z')) current_z = code_value();
+    if (code_seen('E')) current_e = code_value();
+    plan_set_position();
+}
+
+void mcode_M104() { // M104 - set hot-end temp
+    st_synchronize();
+    if (code_seen('S')) heater0.target = code_value();
+}
+
+void mcode_M140() { // M140 - set heated-printbed temp
+    st_synchronize();
+    if (code_seen('S')) heater1.target = code_value();
+}
+
+void mcode_M105() {
+    pc.printf("ok T:");
+    TRACE(TRACE_OK_SENT, 0, 0);
+    if (TEMP_0_PIN != NC) {
+        pc.printf("%f\n", heater0.temperature);
+    } else {
+        pc.printf("0.0\n");
+    }
+    if (!code_seen('N')) cmd_acknowledged[bufindr] = true; // If M105 is sent from generated gcode, then it needs a response.
+}
+
+bool has_thermistor(const heater_t *heater) {
+    return (heater == &heater0 ? TEMP_0_PIN : TEMP_1_PIN) != NC;
+}
+
+void set_wait_target() {
+    wait_heater->target = wait_target;
+    wait_in_window = false;
+}
+
+// Heating up is over once the temperature has stayed within TEMP_WINDOW below the target (or above it) for
+// TEMP_RESIDENCY_TIME, the PID approaches the target from below and takes long for the last degree.
+// A thermistor fault (reported by pid_update()) or a missing thermistor ends it at once.
+bool heater_reached() {
+    if (!has_thermistor(wait_heater) || wait_heater->fault) return true;
+    if (wait_heater->temperature < wait_heater->target - TEMP_WINDOW) {
+        wait_in_window = false;
+        return false;
+    }
+    if (!wait_in_window) {
+        wait_in_window = true;
+        wait_window_entered = millis();
+    }
+    return millis() - wait_window_entered >= TEMP_RESIDENCY_TIME;
+}
+
+// M109, M190: S sets the target once the moves in front are done, then the command waits for the heater
+void wait_for_heater(heater_t *heater) {
+    wait_heater = heater;
+    wait_target = code_seen('S') ? code_value() : heater->target;
+    wait_for(set_wait_target, heater_reached);
+}
+
+void mcode_M109() { // M109 - Wait for heater to reach target.
+    wait_for_heater(&heater0);
+}
+
+void mcode_M190() { // M190 - Wait for the bed to reach its target
+    wait_for_heater(&heater1);
+}
+
+void print_histogram(const char *name, const histogram_t *histogram) {
+    pc.printf("%s:", name);
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        pc.printf(" <%lu:%lu", 1UL << i, histogram->count[i]);
+    }
+    pc.printf(" >=%lu:%lu max:%lu us\n", 1UL << (HISTOGRAM_BUCKETS - 2), histogram->count[HISTOGRAM_BUCKETS - 1], histogram->max);
+}
+
+void mcode_M122() { // M122 - print and clear the timing statistics
+    histogram_t step[4];
+    __disable_irq();
+    for (int i = 0; i < 4; i++) {
+        step[i] = *(histogram_t *)&step_late[i];
+        memset((void *)&step_late[i], 0, sizeof(histogram_t));
+    }
+    __enable_irq();
+
+    print_histogram("X step late", &step[0]);
+    print_histogram("Y step late", &step[1]);
+    print_histogram("Z step late", &step[2]);
+    print_histogram("E step late", &step[3]);
+    print_histogram("loop time", &loop_time);
+    pc.printf("manage_heater gap max: %lu us\n", manage_heater_gap_max);
+    pc.printf("printf: %lu calls, %lu us, max %lu us\n", printf_calls, printf_time, printf_time_max);
+
+    memset(&loop_time, 0, sizeof(loop_time));
+    manage_heater_gap_max = 0;
+    printf_calls = 0;
+    printf_time = 0;
+    printf_time_max = 0;
+}
+
+void mcode_M900() { // M900 - pressure advance factor
+    if (code_seen('K')) advance_k = code_value();
+    pc.printf(" k:%f\n", advance_k);
+}
+
+void mcode_M593() { // M593 - input shaper of X and/or Y
+    bool x = code_seen('X');
+    bool y = code_seen('Y');
+    if (!x && !y) x = y = true;
+
+    st_synchronize(); // the shapers change while they are idle
+    if (code_seen('T')) {
+        int type = (int)code_value();
+        if (type < SHAPER_NONE || type > SHAPER_EI) type = SHAPER_NONE;
+        if (x) x_shaper_type = type;
+        if (y) y_shaper_type = type;
+    }
+    if (code_seen('F')) {
+        float frequency = code_value();
+        if (frequency < SHAPER_MIN_FREQUENCY) frequency = SHAPER_MIN_FREQUENCY;
+        if (x) x_shaper_frequency = frequency;
+        if (y) y_shaper_frequency = frequency;
+    }
+    if (code_seen('D')) {
+        float damping = code_value();
+        if (damping < 0) damping = 0;
+        if (damping > SHAPER_MAX_DAMPING) damping = SHAPER_MAX_DAMPING;
+        if (x) x_shaper_damping = damping;
+        if (y) y_shaper_damping = damping;
+    }
+    update_input_shapers();
+    pc.printf(" x:%d %f Hz %f y:%d %f Hz %f max rate:%lu\n", x_shaper_type, x_shaper_frequency, x_shaper_damping,
+        y_shaper_type, y_shaper_frequency, y_shaper_damping, shaper_max_rate);
+}
+
+void mcode_M420() { // M420 - bed mesh correction on/off and fade height
+    st_synchronize();
+    float z = uncorrected_z();
+    if (code_seen('S')) mesh_enabled = mesh_valid && code_value() != 0;
+    if (code_seen('Z')) {
+        mesh_fade_height = code_value();
+        if (mesh_fade_height < 0) mesh_fade_height = 0;
+    }
+    set_uncorrected_z(z);
+    print_mesh();
+}
+
+void mcode_M870() { // M870 - start or stop the event trace
+    trace_start(code_seen('S') ? (unsigned long)code_value_long() : 0xFFFFFFFFUL);
+}
+
+void mcode_M871() { // M871 - send the event trace
+    trace_mask = 0;
+    unsigned long count = (trace_head < TRACE_SIZE) ? trace_head : TRACE_SIZE;
+    unsigned long first = trace_head - count;
+    pc.printf("trace:%lu lost:%lu us:%lu\n", count, first, (unsigned long)LPC_TIM3->TC);
+
+    unsigned short crc = 0xFFFF;
+    for (unsigned long i = first; i < trace_head; i++) {
+        const trace_event_t *event = &trace_buffer[i & (TRACE_SIZE - 1)];
+        unsigned char bytes[8];
+        binary_put_u32(bytes, event->time);
+        bytes[4] = event->type;
+        bytes[5] = event->arg;
+        binary_put_u16(bytes + 6, event->data);
+        crc = crc16(bytes, sizeof(bytes), crc);
+        for (int j = 0; j < (int)sizeof(bytes); j++) pc.putc(bytes[j]);
+    }
+    unsigned char bytes[2];
+    binary_put_u16(bytes, crc);
+    pc.putc(bytes[0]);
+    pc.putc(bytes[1]);
+    pc.putc('\n');
+}
+
+void mcode_M301() { // M301 - hot-end PID gains
+    if (code_seen('P')) hotend_kp = code_value();
+    if (code_seen('I')) hotend_ki = code_value();
+    if (code_seen('D')) hotend_kd = code_value();
+    pc.printf(" p:%f i:%f d:%f\n", hotend_kp, hotend_ki, hotend_kd);
+}
+
+void mcode_M304() { // M304 - bed PID gains
+    if (code_seen('P')) bed_kp = code_value();
+    if (code_seen('I')) bed_ki = code_value();
+    if (code_seen('D')) bed_kd = code_value();
+    pc.printf(" p:%f i:%f d:%f\n", bed_kp, bed_ki, bed_kd);
+}
+
+// M303 - PID autotune. The heater is switched between bias+d and bias-d whenever the temperature crosses
+// the target, bias is moved until heating and cooling take equally long. The amplitude and period of the
+// resulting oscillation give the ultimate gain Ku and period Tu, the gains follow the Ziegler-Nichols rules.
+void mcode_M303() {
+    heater_t *heater = &heater0;
+    float target = 150.0;
+    int cycles = 5;
+    if (code_seen('E') && code_value() == 1) heater = &heater1;
+    if (code_seen('S')) target = code_value();
+    if (code_seen('C')) cycles = code_value();
+
+    st_synchronize();
+    pc.printf("PID Autotune start\n");
+
+    long bias = PID_MAX/2, d = PID_MAX/2;
+    long t_high = 0, t_low = 0;
+    unsigned long t1 = heater_pwm_periods, t2 = heater_pwm_periods; // start of the cooling and the heating half
+    float max_temperature = 0, min_temperature = 10000;
+    float kp = 0, ki = 0, kd = 0;
+    bool heating = true;
+    int cycle = 0;
+
+    heater->target = 0; // the PID of the other heater keeps running, this one is switched by hand
+    heater->manual = true;
+    heater->duty = PID_MAX;
+
+    while (cycle <= cycles) {
+        unsigned long now = heater_pid_period;
+        run_tasks();
+        if (now == heater_pid_period) continue; // no new reading yet
+        now = heater_pid_period;
+
+        float temperature = heater->temperature;
+        if (temperature > max_temperature) max_temperature = temperature;
+        if (temperature < min_temperature) min_temperature = temperature;
+
+        if (heating && temperature > target && (now - t2)*PID_INTERVAL > 5.0) {
+            heating = false;
+            heater->duty = bias - d;
+            t1 = now;
+            t_high = t1 - t2;
+            max_temperature = temperature;
+        }
+        if (!heating && temperature < target && (now - t1)*PID_INTERVAL > 5.0) {
+            heating = true;
+            t2 = now;
+            t_low = t2 - t1;
+            if (cycle > 0) {
+                bias += (d*(t_high - t_low))/(t_low + t_high);
+                if (bias < 20) bias = 20;
+                if (bias > PID_MAX - 20) bias = PID_MAX - 20;
+                d = (bias > PID_MAX/2) ? PID_MAX - 1 - bias : bias;
+
+                pc.printf(" bias: %ld d: %ld min: %f max: %f\n", bias, d, min_temperature, max_temperature);
+                if (cycle > 2) {
+                    float ku = (4.0*d)/(PI*(max_temperature - min_temperature)/2.0);
+                    float tu = (t_low + t_high)*PID_INTERVAL;
+                    kp = 0.6*ku;
+                    ki = 2*kp/tu;
+                    kd = kp*tu/8;
+                    pc.printf(" Ku: %f Tu: %f\n", ku, tu);
+                    pc.printf(" Kp: %f Ki: %f Kd: %f\n", kp, ki, kd);
+                }
+            }
+            heater->duty = bias + d;
+            cycle++;
+            min_temperature = temperature;
+        }
+        if (temperature > target + 20) {
+            pc.printf("PID Autotune failed! Temperature too high\n");
+            break;
+        }
+        if ((now - (heating ? t2 : t1))*PID_INTERVAL > 20*60) { // no crossing for 20 minutes
+            pc.printf("PID Autotune failed! timeout\n");
+            break;
+        }
+    }
+    if (cycle > cycles) {
+        pc.printf("PID Autotune finished! Set the gains with M%d P%f I%f D%f\n", heater == &heater0 ? 301 : 304, kp, ki, kd);
+    }
+
+    heater->duty = 0;
+    heater->manual = false;
+}
+
+void mcode_M106() { //M106 Fan On
+    st_synchronize();
+    p_fan = 1;
+}
+
+void mcode_M107() { //M107 Fan Off
+    st_synchronize();
+    p_fan = 0;
+}
 
+void mcode_M20() { // M20 - list files
+    DIR *dir = opendir(FILE_SYSTEM_ROOT);
+    pc.printf("Begin file list\n");
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            pc.printf("%s\n", entry->d_name);
         }
+        closedir(dir);
+    }
+    pc.printf("End file list\n");
+}
+
+void mcode_M23() { // M23 - select file
+    char path[64];
+    // Binary packets only carry numbers, the file name has to come in an ASCII line, see M860
+    const char *name = strstr(cmdbuffer[bufindr], "M23");
+    if (!name) {
+        pc.printf("M23 needs a file name, send it as ASCII after M860 S0.\n");
+        return;
+    }
+    name += 3;
+    while (*name == ' ') name++;
+    int length = strcspn(name, "*");
+    while (length && name[length - 1] == ' ') length--;
+    if (length > (int)(sizeof(path) - sizeof(FILE_SYSTEM_ROOT) - 1)) length = sizeof(path) - sizeof(FILE_SYSTEM_ROOT) - 1;
+    sprintf(path, "%s/%.*s", FILE_SYSTEM_ROOT, length, name);
+
+    file_close();
+    print_file = fopen(path, "r");
+    if (!print_file) {
+        pc.printf("open failed, File: %s.\n", path);
+        return;
+    }
+    fseek(print_file, 0, SEEK_END);
+    file_size = ftell(print_file);
+    file_seek(0);
+    file_lines = 0;
+    file_time = 0;
+    pc.printf("File opened: %s Size: %ld\n", path, file_size);
+    pc.printf("File selected\n");
+}
+
+void mcode_M24() { // M24 - start/resume file print
+    if (!print_file || file_printing) return;
+    file_printing = true;
+    file_time_started = micros64();
+}
+
+void mcode_M25() { // M25 - pause file print
+    if (file_printing) file_time += micros64() - file_time_started;
+    file_printing = false;
+}
+
+void mcode_M26() { // M26 - set file position
+    if (print_file && code_seen('S')) file_seek(code_value_long());
+}
+
+void mcode_M27() { // M27 - report file print progress
+    if (print_file) {
+        pc.printf("SD printing byte %ld/%ld\n", file_position, file_size);
+    } else {
+        pc.printf("Not SD printing\n");
+    }
+}
+
+void mcode_M80() { // M81 - ATX Power On
+    //if(PS_ON_PIN > -1) pinMode(PS_ON_PIN,OUTPUT); //GND
+}
+
+void mcode_M81() { // M81 - ATX Power Off
+    //if(PS_ON_PIN > -1) pinMode(PS_ON_PIN,INPUT); //Floating
+}
+
+void mcode_M82() {
+    relative_mode_e = false;
+}
+
+void mcode_M83() {
+    relative_mode_e = true;
+}
+
+void mcode_M84() {
+    st_synchronize();
+    axes_list::disable(ALL_AXES);
+}
+
+void mcode_M85() { // M85
+    code_seen('S');
+    max_inactive_time = code_value()*1000;
+}
+
+void mcode_M86() { // M86 If Endstop is Not Activated then Abort Print
+    st_synchronize();
+    if (code_seen('X')) {
+        if (x_axis::has_min_endstop && !x_axis::min_endstop_hit()) {
+            kill(3);
+        }
+    }
+    if (code_seen('Y')) {
+        if (y_axis::has_min_endstop && !y_axis::min_endstop_hit()) {
+            kill(4);
+        }
+    }
+}
+
+void mcode_M92() { // M92
+    st_synchronize();
+    if (code_seen('X')) x_steps_per_unit = code_value();
+    if (code_seen('Y')) y_steps_per_unit = code_value();
+    if (code_seen('Z')) z_steps_per_unit = code_value();
+    if (code_seen('E')) e_steps_per_unit = code_value();
+    update_axis_constants();
+    plan_set_position();
+}
+
+void mcode_M201() { // M201
+    if (code_seen('X')) x_max_acceleration = code_value();
+    if (code_seen('Y')) y_max_acceleration = code_value();
+    if (code_seen('Z')) z_max_acceleration = code_value();
+    if (code_seen('E')) e_max_acceleration = code_value();
+    update_axis_constants();
+}
+
+void mcode_M204() { // M204
+    if (code_seen('S')) acceleration = code_value();
+    update_axis_constants();
+}
+
+typedef struct {
+    int code;
+    void (*handler)();
+} command_handler_t;
+
+const command_handler_t gcode_table[] = {
+    {0, gcode_G1},
+    {1, gcode_G1},
+    {2, gcode_G2},
+    {3, gcode_G3},
+    {4, gcode_G4},
+    {29, gcode_G29},
+    {90, gcode_G90},
+    {91, gcode_G91},
+    {92, gcode_G92},
+};
+
+const command_handler_t mcode_table[] = {
+    {20, mcode_M20},
+    {23, mcode_M23},
+    {24, mcode_M24},
+    {25, mcode_M25},
+    {26, mcode_M26},
+    {27, mcode_M27},
+    {80, mcode_M80},
+    {81, mcode_M81},
+    {82, mcode_M82},
+    {83, mcode_M83},
+    {84, mcode_M84},
+    {85, mcode_M85},
+    {86, mcode_M86},
+    {92, mcode_M92},
+    {104, mcode_M104},
+    {105, mcode_M105},
+    {106, mcode_M106},
+    {107, mcode_M107},
+    {109, mcode_M109},
+    {122, mcode_M122},
+    {140, mcode_M140},
+    {190, mcode_M190},
+    {201, mcode_M201},
+    {301, mcode_M301},
+    {303, mcode_M303},
+    {304, mcode_M304},
+    {204, mcode_M204},
+    {870, mcode_M870},
+    {871, mcode_M871},
+    {900, mcode_M900},
+    {593, mcode_M593},
+    {420, mcode_M420},
+};
+
+#define TABLE_SIZE(table) (sizeof(table)/sizeof(table[0]))
+
+// Run the handler for code, unknown codes are ignored
+void dispatch_command(const command_handler_t *table, int table_size, int code) {
+    for (int i = 0; i < table_size; i++) {
+        if (table[i].code == code) {
+            table[i].handler();
+            return;
+        }
+    }
+}
+
+void process_commands() {
+    command = &commands[bufindr];
+
+    if (code_seen('G')) {
+        dispatch_command(gcode_table, TABLE_SIZE(gcode_table), (int)code_value());
     }
 
     if (code_seen('M')) {
+        dispatch_command(mcode_table, TABLE_SIZE(mcode_table), (int)code_value());
+    }
 
-        switch ( (int)code_value() ) {
-            case 104: // M104 - set hot-end temp
-                
-                if (code_seen('S'))
-                {
-                     
-                    target_raw = temp2analog(code_value());
-                    //pc.printf("target_raw: %d\n ", target_raw);
-                }
-                break;
-        case 140: // M140 - set heated-printbed temp
-                if (code_seen('S'))
-                {
-                     
-                    target_raw1 = temp2analog(code_value());
-                    //pc.printf("target_raw1: %d\n ", target_raw);
-                }
-                break;                
-                
-            case 105: // M105
-                pc.printf("ok T:");
-                if (TEMP_0_PIN != NC) {
-                    pc.printf("%f\n", analog2temp( (p_temp0.read_u16())  ));
-                } else {
-                    pc.printf("0.0\n");
-                }
-                if (!code_seen('N')) return; // If M105 is sent from generated gcode, then it needs a response.
-                break;
-            case 109: // M109 - Wait for heater to reach target.
-                if (code_seen('S')) target_raw = temp2analog(code_value());
-                previous_millis_heater = millis();
-                while (current_raw < target_raw) {
-                    if ( (millis()-previous_millis_heater) > 1000 ) { //Print Temp Reading every 1 second while heating up.
-                        pc.printf("ok T:");
-                        if (TEMP_0_PIN != NC) {
-                            pc.printf("%f\n", analog2temp(p_temp0.read_u16()));
-                        } else {
-                            pc.printf("0.0\n");
-                        }
-                        previous_millis_heater = millis();
-                    }
-                    manage_heater();
-                }
-                break;
-            case 106: //M106 Fan On
-                p_fan = 1;
-                break;
-            case 107: //M107 Fan Off
-                p_fan = 0;
-                break;
-            case 80: // M81 - ATX Power On
-                //if(PS_ON_PIN > -1) pinMode(PS_ON_PIN,OUTPUT); //GND
-                break;
-            case 81: // M81 - ATX Power Off
-                //if(PS_ON_PIN > -1) pinMode(PS_ON_PIN,INPUT); //Floating
-                break;
-            case 82:
-                relative_mode_e = false;
-                break;
-            case 83:
-                relative_mode_e = true;
-                break;
-            case 84:
-                disable_x();
-                disable_y();
-                disable_z();
-                disable_e();
-                break;
-            case 85: // M85
-                code_seen('S');
-                max_inactive_time = code_value()*1000;
-                break;
-            case 86: // M86 If Endstop is Not Activated then Abort Print
-                if (code_seen('X')) {
-                    if (X_MIN_PIN != NC) {
-                        if ( p_X_min == ENDSTOPS_INVERTING ) {
-                            kill(3);
-                        }
-                    }
-                }
-                if (code_seen('Y')) {
-                    if (Y_MIN_PIN != NC) {
-                        if ( p_Y_min == ENDSTOPS_INVERTING ) {
-                            kill(4);
-                        }
-                    }
-                }
-                break;
-            case 92: // M92
-                if (code_seen('X')) x_steps_per_unit = code_value();
-                if (code_seen('Y')) y_steps_per_unit = code_value();
-                if (code_seen('Z')) z_steps_per_unit = code_value();
-                if (code_seen('E')) e_steps_per_unit = code_value();
-                break;
+    if (!cmd_acknowledged[bufindr]) ClearToSend();
+}
+
+
+// Serial receive interrupt, only moves the received bytes into rx_buffer
+void serial_rx_isr() {
+    while (pc.readable()) {
+        char c = pc.getc();
+        int next = (rx_buffer_head + 1) & (RX_BUFFER_SIZE - 1);
+        if (next != rx_buffer_tail) {
+            rx_buffer[rx_buffer_head] = c;
+            rx_buffer_head = next;
         }
+    }
+}
 
+// Queue the command in cmdbuffer[bufindw] / commands[bufindw] if its line number and checksum are fine.
+// It is acknowledged right away so the host can send the next one while the queue is worked off,
+// except for M105, which answers with its own "ok T:" once it runs.
+void queue_command() {
+    command_t *cmd = &commands[bufindw];
+
+    if (!check_line(cmd)) return;
+    TRACE(TRACE_LINE_RECEIVED, 0, cmd->line_number);
+
+    // M860 takes effect here and not in process_commands(), the next bytes are already on their way
+    if (command_is(cmd, 'M', 860)) {
+        binary_mode = !(cmd->seen & (1UL << ('S' - 'A'))) || cmd->value['S' - 'A'] != 0.0;
     }
 
-    ClearToSend();
+    cmd_acknowledged[bufindw] = !command_is(cmd, 'M', 105);
+    if (cmd_acknowledged[bufindw]) ClearToSend();
+    bufindw = (bufindw + 1) % BUFSIZE;
+    buflen++;
 }
 
+// Fill a command from a received packet, the same way parse_command() does from a line.
+// Returns false if the CRC doesn't match.
+bool decode_binary_command(const unsigned char *packet, command_t *cmd) {
+    if (!binary_crc_ok(packet)) return false;
+
+    unsigned long mask = binary_get_u32(packet + 6) & 0x3FFFFFF;
+    const unsigned char *p = packet + BINARY_HEADER_SIZE;
+    for (int i = 0; i < 26; i++) {
+        if (mask & (1UL << i)) {
+            cmd->value[i] = binary_get_float(p);
+            p += BINARY_FIELD_SIZE;
+        }
+    }
+    if (packet[3] >= 'A' && packet[3] <= 'Z') {
+        mask |= 1UL << (packet[3] - 'A');
+        cmd->value[packet[3] - 'A'] = binary_get_u16(packet + 4);
+    }
 
-void get_command() {
-    if ( pc.readable() ) {
-        serial_char = pc.getc();
+    // The sequence number is the low 16 bits of the line number, check_line() handles it like N
+    cmd->line_number = ((gcode_LastN + 1) & ~0xFFFFL) | binary_get_u16(packet + 1);
+    cmd->value['N' - 'A'] = cmd->line_number;
+    cmd->seen = mask | (1UL << ('N' - 'A'));
+    cmd->has_checksum = true;
+    cmd->checksum = cmd->checksum_received = 0; // the CRC already covered it
+    return true;
+}
 
-        if (serial_char == '\n' || serial_char == '\r' || serial_char == ':' || serial_count >= (MAX_CMD_SIZE - 1) ) {
-            if (!serial_count) {
-                return; //empty line
+// Collect the bytes of a packet in cmdbuffer[bufindw]
+void get_binary_command(unsigned char c) {
+    unsigned char *packet = (unsigned char *)cmdbuffer[bufindw];
+
+    if (!serial_count && c != BINARY_SYNC) return; // wait for the start of a packet
+    packet[serial_count++] = c;
+    if (serial_count < BINARY_HEADER_SIZE || serial_count < binary_packet_size(packet)) return;
+    serial_count = 0;
+
+    if (!decode_binary_command(packet, &commands[bufindw])) {
+        FlushSerialRequestResend();
+        return;
+    }
+    cmdbuffer[bufindw][0] = 0; // no text for code_seen(char code_string[])
+    queue_command();
+}
+
+// Queue commands from the print file. A whole line is taken at once and only while no line from the host
+// is half received, so the two never share cmdbuffer[bufindw].
+void get_file_commands() {
+    while (file_printing && !serial_count && buflen < BUFSIZE) {
+        int count = 0;
+        bool comment = false;
+        bool end_of_file = false;
+
+        for (;;) {
+            if (file_block_pos >= file_block_length[file_block_read] && !file_next_block()) {
+                end_of_file = true;
+                break;
             }
-            cmdbuffer[serial_count] = 0; //terminate string
+            char c = file_block[file_block_read][file_block_pos++];
+            file_position++;
+            if (c == '\n' || c == '\r') break;
+            if (c == ';') comment = true;
+            if (!comment && count < MAX_CMD_SIZE - 1) cmdbuffer[bufindw][count++] = c;
+        }
+
+        if (count) {
+            cmdbuffer[bufindw][count] = 0;
+            parse_command(cmdbuffer[bufindw], &commands[bufindw]);
+            cmd_acknowledged[bufindw] = true; // not sent by the host, so no ok
+            previous_millis_cmd = millis(); // but it counts as activity like one that was, see M85
+            bufindw = (bufindw + 1) % BUFSIZE;
+            buflen++;
+            file_lines++;
+            TRACE(TRACE_LINE_RECEIVED, 1, file_lines);
+        }
 
-            process_commands();
+        if (end_of_file) {
+            file_close();
+            pc.printf("Done printing file\n");
+            pc.printf("%ld lines in %f s\n", file_lines, file_time/1000000.0);
+        }
+    }
+    file_read_ahead();
+}
 
+// Assemble received bytes into lines or packets and queue them in cmdbuffer, then top the queue up from the print file
+void get_command() {
+    while (rx_buffer_tail != rx_buffer_head && buflen < BUFSIZE) {
+        serial_char = rx_buffer[rx_buffer_tail];
+        rx_buffer_tail = (rx_buffer_tail + 1) & (RX_BUFFER_SIZE - 1);
+
+        if (binary_mode) {
+            get_binary_command(serial_char);
+            continue;
+        }
+
+        if (serial_char == '\n' || serial_char == '\r' || serial_char == ':' || serial_count >= (MAX_CMD_SIZE - 1) ) {
             comment_mode = false; //for new command
+            if (!serial_count) {
+                continue; //empty line
+            }
+            cmdbuffer[bufindw][serial_count] = 0; //terminate string
             serial_count = 0; //clear buffer
-            //Serial.println("ok");
+
+            parse_command(cmdbuffer[bufindw], &commands[bufindw]);
+            queue_command();
         } else {
             if (serial_char == ';') {
                 comment_mode = true;
             }
             if (!comment_mode) {
-                cmdbuffer[serial_count++] = serial_char;
+                cmdbuffer[bufindw][serial_count++] = serial_char;
             }
         }
     }
 
+    get_file_commands();
+}
+
+// While M109 or M190 heats up: the temperatures, without the "ok" of M105 since they don't answer a command
+void report_temperatures() {
+    if (command_wait != heater_reached || !wait_moves_done) return;
+    pc.printf("T:%f", heater0.temperature);
+    if (TEMP_1_PIN != NC) pc.printf(" B:%f", heater1.temperature);
+    pc.printf("\n");
+}
+
+void check_inactivity() {
+    manage_inactivity(1); //shutdown if not receiving any new commands
+}
 
+// Cooperative tasks. Each one returns as soon as it has nothing to do, so run_tasks() keeps all of them
+// going while loop() processes the commands, a command waits (G4, M109, M190, see wait_for()) or
+// st_synchronize() waits for the moves.
+typedef struct {
+    void (*run)();
+    unsigned long interval; // ms between two runs, 0 = every time
+    unsigned long last_run; // millis()
+} task_t;
+
+task_t tasks[] = {
+    {get_command, 0, 0}, // the host and the print file
+    {manage_heater, 0, 0},
+    {check_inactivity, 100, 0},
+    {report_temperatures, 1000, 0},
+};
+
+void run_tasks() {
+    unsigned long now = millis();
+    for (unsigned int i = 0; i < TABLE_SIZE(tasks); i++) {
+        task_t *task = &tasks[i];
+        if (task->interval && now - task->last_run < task->interval) continue;
+        task->last_run = now;
+        task->run();
+    }
 }
 
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 void setup() {
+    build_temptable();
+    update_axis_constants();
+    update_input_shapers();
+    mesh_load();
+    plan_set_position(); // the motor positions of (0,0,0), on a delta the carriages are far from 0
     pc.baud(BAUDRATE);
+    pc.attach(&serial_rx_isr, Serial::RxIrq);
+    NVIC_SetPriority(UART0_IRQn, 1); // below the stepper interrupt
+    heater_ticker.attach_us(&heater_pwm_isr, HEATER_PWM_TICK_US);
+    NVIC_SetPriority(TIMER3_IRQn, 2); // Ticker runs on timer 3, below the stepper and the serial interrupt
+    loop_started = manage_heater_called = micros();
     pc.printf("start\n");//RepRap
     //pc.printf("A:\n");//HYDRA
 }
 
 void loop() {
-    get_command();
-    
-    manage_heater();
-    
-    manage_inactivity(1); //shutdown if not receiving any new commands
+    unsigned long now = micros();
+    unsigned long time = now - loop_started;
+    histogram_add(&loop_time, histogram_bucket(time), time);
+    loop_started = now;
+
+    run_tasks();
+
+    if (!command_waiting() && buflen) {
+        process_commands();
+        buflen--;
+        bufindr = (bufindr + 1) % BUFSIZE;
+    }
+
+    //Start the queued moves once the queue is full or the host has stopped sending new ones for a while
+    if (next_block_index(block_buffer_head) == block_buffer_tail || (!serial_count && (millis() - previous_millis_planner) >= PLANNER_IDLE_TIME)) {
+        st_wake_up();
+    }
 }
 
 int main() {
     timer.start();
+    st_init();
     setup();
 
     while (1) {
@@ -0,0 +1,266 @@
+// Benchmark of the firmware code paths on the PC, see sim/README.
+//
+//   bench corpus.gcode [runs]
+//
+// Times the parser, the move setup, the step loop and analog2temp() of main.cpp on the lines of the
+// corpus and writes the results as JSON to stdout. The numbers are host CPU time, good for comparing
+// two versions of the firmware on the same machine, not for predicting the time on the LPC1768.
+// Each stage is repeated runs times (default 5), the fastest run counts.
+
+#ifdef BENCHMARK
+
+#include <time.h>
+
+#define main firmware_main
+#include "../main.cpp"
+#undef main
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// The corpus, without comments and empty lines, the way get_command() hands the lines to parse_command()
+static char **lines;
+static command_t *parsed;
+static int line_count = 0;
+static int move_count = 0;
+static unsigned long blocks_planned = 0; // by bench_move_setup(), arcs give many blocks per line
+
+static void read_corpus(const char *name) {
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        fprintf(stderr, "can't open %s\n", name);
+        exit(1);
+    }
+    int size = 1024;
+    lines = (char **)malloc(size*sizeof(char *));
+    char line[MAX_CMD_SIZE];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, ";\r\n")] = 0;
+        if (!line[0]) continue;
+        if (line_count == size) {
+            size *= 2;
+            lines = (char **)realloc(lines, size*sizeof(char *));
+        }
+        lines[line_count++] = strdup(line);
+    }
+    fclose(f);
+    parsed = (command_t *)malloc((line_count + 1)*sizeof(command_t));
+}
+
+static bool is_move(const command_t *cmd) {
+    return command_is(cmd, 'G', 0) || command_is(cmd, 'G', 1) || command_is(cmd, 'G', 2) || command_is(cmd, 'G', 3);
+}
+
+// G90, G91, G92, M82 and M83 change how the moves after them are read, the other codes don't matter here
+static bool is_mode_change(const command_t *cmd) {
+    return command_is(cmd, 'G', 90) || command_is(cmd, 'G', 91) || command_is(cmd, 'G', 92)
+        || command_is(cmd, 'M', 82) || command_is(cmd, 'M', 83);
+}
+
+// Back to the state after a reset, with an empty move queue
+static void reset_machine() {
+    block_buffer_head = block_buffer_tail = 0;
+    current_block = NULL;
+    stepper_running = false;
+    previous_nominal_speed = 0.0;
+    current_x = current_y = current_z = current_e = 0.0;
+    position_x = position_y = position_z = position_e = 0;
+    relative_mode = relative_mode_e = false;
+    feedrate = 1500;
+}
+
+// parse_command() and what process_commands() and get_coordinates() then read from the command
+static double bench_parse() {
+    reset_machine();
+    double start = now_ns();
+    for (int i = 0; i < line_count; i++) {
+        command = &parsed[i];
+        parse_command(lines[i], command);
+        if (code_seen('G')) {
+            int code = (int)code_value();
+            if (code <= 3) get_coordinates();
+        } else if (code_seen('M')) {
+            code_value();
+        }
+    }
+    return now_ns() - start;
+}
+
+// Run a parsed command that matters for the moves. Before G92 the queue is emptied with
+// empty_queue(), so its st_synchronize() finds nothing to wait for.
+static void run_command(command_t *cmd, void (*empty_queue)()) {
+    command = cmd;
+    if (command_is(cmd, 'G', 92)) empty_queue();
+    if (code_seen('G')) dispatch_command(gcode_table, TABLE_SIZE(gcode_table), (int)code_value());
+    else if (code_seen('M')) dispatch_command(mcode_table, TABLE_SIZE(mcode_table), (int)code_value());
+}
+
+// Drop the oldest block without executing it, as if stepper_isr() had just finished it
+static void drop_oldest_block() {
+    block_buffer_tail = next_block_index(block_buffer_tail);
+    blocks_planned++;
+}
+
+static void drop_all_blocks() {
+    while (blocks_queued()) drop_oldest_block();
+}
+
+// With a full queue plan_buffer_line() calls st_wake_up() and run_tasks() until stepper_isr() has freed a
+// block. While a stage runs, free_block_task() is the only task: it stops the stepper again and frees the
+// oldest block the way the stage does, so every block is set up and stepped inside the timed code.
+static task_t firmware_tasks[TABLE_SIZE(tasks)];
+static void (*free_block)();
+
+static void free_block_task() {
+    LPC_TIM2->TCR = 0;
+    stepper_running = false;
+    free_block();
+}
+
+static void no_task() {
+}
+
+static void replace_tasks(void (*free_oldest_block)()) {
+    memcpy(firmware_tasks, tasks, sizeof(tasks));
+    for (unsigned int i = 0; i < TABLE_SIZE(tasks); i++) {
+        tasks[i].run = i ? no_task : free_block_task;
+        tasks[i].interval = 0;
+    }
+    free_block = free_oldest_block;
+}
+
+static void restore_tasks() {
+    memcpy(tasks, firmware_tasks, sizeof(tasks));
+}
+
+// get_coordinates(), plan_buffer_line() and the planner passes, with the queue kept full like while printing
+static double bench_move_setup() {
+    replace_tasks(drop_oldest_block);
+    reset_machine();
+    blocks_planned = 0;
+    double start = now_ns();
+    for (int i = 0; i < line_count; i++) {
+        command_t *cmd = &parsed[i];
+        if (!is_move(cmd) && !is_mode_change(cmd)) continue;
+        run_command(cmd, drop_all_blocks);
+    }
+    double time = now_ns() - start;
+    drop_all_blocks();
+    restore_tasks();
+    return time;
+}
+
+// stepper_isr() called back to back for the step events and the edges of their pulses, only the time
+// inside it counts
+static double step_loop_ns;
+static unsigned long step_events;
+static unsigned long steps;
+
+static void run_oldest_block() {
+    int tail = block_buffer_tail;
+    double start = now_ns();
+    do {
+        sim_tim2.IR.value = 1;
+        stepper_isr();
+        while (pulse_axes) {
+            sim_tim2.IR.value = 2;
+            stepper_isr();
+        }
+        step_events++;
+    } while (block_buffer_tail == tail);
+    step_loop_ns += now_ns() - start;
+
+    block_t *block = &block_buffer[tail];
+    for (int i = 0; i < NUM_AXES; i++) steps += block->steps_to_take[i];
+}
+
+static void run_all_blocks() {
+    while (blocks_queued()) run_oldest_block();
+}
+
+static double bench_step_loop() {
+    replace_tasks(run_oldest_block);
+    reset_machine();
+    step_loop_ns = 0;
+    step_events = 0;
+    steps = 0;
+    for (int i = 0; i < line_count; i++) {
+        command_t *cmd = &parsed[i];
+        if (!is_move(cmd) && !is_mode_change(cmd)) continue;
+        run_command(cmd, run_all_blocks);
+    }
+    run_all_blocks();
+    restore_tasks();
+    return step_loop_ns;
+}
+
+#define ANALOG2TEMP_CALLS 1000000
+
+static double bench_analog2temp() {
+    volatile float sum = 0;
+    double start = now_ns();
+    for (int i = 0; i < ANALOG2TEMP_CALLS; i++) {
+        sum += analog2temp((i*7919UL) & 0xFFFF);
+    }
+    return now_ns() - start;
+}
+
+static double fastest(double (*stage)(), int runs) {
+    double best = stage();
+    for (int i = 1; i < runs; i++) {
+        double t = stage();
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s corpus.gcode [runs]\n", argv[0]);
+        return 1;
+    }
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    if (runs < 1) runs = 1;
+
+    build_temptable();
+    update_axis_constants();
+    timer.start();
+    st_init();
+    read_corpus(argv[1]);
+    if (!line_count) {
+        fprintf(stderr, "no G-code in %s\n", argv[1]);
+        return 1;
+    }
+
+    double parse = fastest(bench_parse, runs);
+    for (int i = 0; i < line_count; i++) {
+        if (is_move(&parsed[i])) move_count++;
+    }
+    double move_setup = fastest(bench_move_setup, runs);
+    double step_loop = fastest(bench_step_loop, runs);
+    double analog = fastest(bench_analog2temp, runs);
+
+    unsigned long blocks = blocks_planned ? blocks_planned : 1;
+    int events = step_events ? step_events : 1;
+    printf("{\n");
+    printf("  \"corpus\": \"%s\",\n", argv[1]);
+    printf("  \"runs\": %d,\n", runs);
+    printf("  \"lines\": %d,\n", line_count);
+    printf("  \"moves\": %d,\n", move_count);
+    printf("  \"blocks\": %lu,\n", blocks_planned);
+    printf("  \"step_events\": %lu,\n", step_events);
+    printf("  \"steps\": %lu,\n", steps);
+    printf("  \"parse\": {\"ns_per_line\": %.1f, \"lines_per_s\": %.0f},\n", parse/line_count, line_count*1e9/parse);
+    printf("  \"move_setup\": {\"ns_per_block\": %.1f, \"blocks_per_s\": %.0f},\n", move_setup/blocks, blocks*1e9/move_setup);
+    printf("  \"lines_per_s\": %.0f,\n", line_count*1e9/(parse + move_setup));
+    printf("  \"step_loop\": {\"ns_per_step_event\": %.1f, \"max_step_events_per_s\": %.0f, \"max_steps_per_s\": %.0f},\n",
+        step_loop/events, events*1e9/step_loop, steps*1e9/step_loop);
+    printf("  \"analog2temp\": {\"ns_per_call\": %.2f}\n", analog/ANALOG2TEMP_CALLS);
+    printf("}\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,118 @@
+// Checks of main.cpp against reference calculations on the PC, see sim/README.
+//
+//   check
+//
+// Prints one line per check and exits with 1 if any of them failed.
+
+#ifdef CHECK
+
+#define main firmware_main
+#include "../main.cpp"
+#undef main
+
+static int failures = 0;
+
+static void report(const char *name, bool ok, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("%s %s: ", ok ? "ok  " : "FAIL", name);
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    if (!ok) failures++;
+}
+
+// The beta model of ThermistorTable.h in double precision, for the reading raw
+static double beta_temperature(double raw) {
+    double r = THERMISTOR_R2*raw/(THERMISTOR_MAX_ADC - raw);
+    if (THERMISTOR_R1 > 0) r = 1.0/(1.0/r - 1.0/THERMISTOR_R1);
+    return 1.0/(1.0/(THERMISTOR_T0 + 273.15) + log(r/THERMISTOR_R0)/THERMISTOR_BETA) - 273.15;
+}
+
+// analog2temp() on every reading between a short and an open thermistor, against the beta model.
+// ThermistorTable.h promises 0.2 degrees C from 0 up to 300 degrees C. Below and above that the table
+// entries lie further apart in temperature, and from THERMISTOR_MAX_TEMP up it stops at that value,
+// so there the readings only have to stay hot. Whatever the range, a higher reading is never warmer.
+typedef struct {
+    double from, to; // degrees C of the beta model
+    double tolerance; // degrees C
+} thermistor_range_t;
+
+static const thermistor_range_t thermistor_ranges[] = {
+    {-10.0, 0.0, 0.5},
+    {0.0, 300.0, 0.2},
+    {300.0, 400.0, 2.0},
+};
+#define THERMISTOR_HOT 400.0 // degrees C, hotter readings only have to read at least this much
+
+static void check_analog2temp() {
+    for (unsigned int i = 0; i < TABLE_SIZE(thermistor_ranges); i++) {
+        const thermistor_range_t *range = &thermistor_ranges[i];
+        double worst = 0, worst_reference = 0;
+        for (int raw = THERMISTOR_SHORT_RAW; raw <= THERMISTOR_OPEN_RAW; raw++) {
+            double reference = beta_temperature(raw);
+            if (reference < range->from || reference > range->to) continue;
+            double error = fabs(analog2temp(raw) - reference);
+            if (error > worst) {
+                worst = error;
+                worst_reference = reference;
+            }
+        }
+        char name[64];
+        sprintf(name, "analog2temp %.0f to %.0f C", range->from, range->to);
+        report(name, worst <= range->tolerance, "max error %.3f C at %.1f C, tolerance %.1f C", worst, worst_reference, range->tolerance);
+    }
+
+    float coldest_hot = THERMISTOR_MAX_TEMP;
+    int rises = 0;
+    for (int raw = THERMISTOR_SHORT_RAW; raw <= THERMISTOR_OPEN_RAW; raw++) {
+        if (beta_temperature(raw) > THERMISTOR_HOT && analog2temp(raw) < coldest_hot) coldest_hot = analog2temp(raw);
+        if (raw > THERMISTOR_SHORT_RAW && analog2temp(raw) > analog2temp(raw - 1)) rises++;
+    }
+    report("analog2temp hot", coldest_hot >= THERMISTOR_HOT, "coldest reading %.1f C above %.0f C", coldest_hot, THERMISTOR_HOT);
+    report("analog2temp falling", !rises, "%d readings warmer than the one below them", rises);
+}
+
+// set_step_pins() for every combination of axes, both levels: one FIOSET or FIOCLR per port that has
+// step pins of those axes, with exactly their bits, see Axis.h
+static void check_step_pins() {
+    const PinName pins[NUM_AXES] = {X_STEP_PIN, Y_STEP_PIN, Z_STEP_PIN, E_STEP_PIN}; // X_AXIS...
+    int wrong = 0, most_writes = 0;
+    for (int axes = 0; axes <= ALL_AXES; axes++) {
+        for (int high = 0; high <= 1; high++) {
+            unsigned long expected[GPIO_PORTS] = {0, 0, 0, 0, 0};
+            int ports = 0;
+            for (int i = 0; i < NUM_AXES; i++) {
+                if ((axes & (1 << i)) && pins[i] != NC) expected[PIN_PORT(pins[i])] |= PIN_MASK(pins[i]);
+            }
+            for (int port = 0; port < GPIO_PORTS; port++) {
+                if (expected[port]) ports++;
+            }
+
+            sim_write_log_count = 0;
+            set_step_pins(axes, high);
+            bool ok = sim_write_log_count == ports;
+            for (int i = 0; ok && i < sim_write_log_count; i++) {
+                const sim_port_write_t *write = &sim_write_log[i];
+                ok = write->level == high && write->mask == expected[write->port];
+                expected[write->port] = 0; // a second write of the same port fails
+            }
+            if (!ok) {
+                printf("  axes %x %s: %d writes for %d ports\n", axes, high ? "high" : "low", sim_write_log_count, ports);
+                wrong++;
+            }
+            if (sim_write_log_count > most_writes) most_writes = sim_write_log_count;
+        }
+    }
+    report("set_step_pins", !wrong, "%d of %d axis combinations and levels wrong, at most %d writes per edge",
+        wrong, 2*(ALL_AXES + 1), most_writes);
+}
+
+int main() {
+    build_temptable();
+    check_analog2temp();
+    check_step_pins();
+    return failures ? 1 : 0;
+}
+
+#endif
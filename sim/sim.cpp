@@ -0,0 +1,390 @@
+// Host side of the simulator: virtual clock, interrupts, G-code host, GPIO recorder and thermal model.
+// Only built for the PC, with -DSIMULATOR (see sim/README). The mbed compiler builds every .cpp of the
+// project, this one comes out empty there.
+
+#ifdef SIMULATOR
+
+#include "sim_mbed.h"
+#include "../pins.h"
+
+unsigned long long sim_ns = 0;
+int sim_irq_disabled = 0;
+unsigned short sim_adc[SIM_PINS];
+
+// FIOPIN reads the inputs, no endstops are wired and they float high like in DigitalIn
+LPC_GPIO_TypeDef sim_gpio[5] = {
+    {0, 0, 0xFFFFFFFF, {0}, {0}}, {0, 0, 0xFFFFFFFF, {1}, {1}}, {0, 0, 0xFFFFFFFF, {2}, {2}},
+    {0, 0, 0xFFFFFFFF, {3}, {3}}, {0, 0, 0xFFFFFFFF, {4}, {4}}
+};
+LPC_TIM_TypeDef sim_tim2, sim_tim3;
+LPC_SC_TypeDef sim_sc;
+
+static int in_isr = 0;
+
+static const char *env(const char *name, const char *fallback) {
+    const char *value = getenv(name);
+    return value ? value : fallback;
+}
+
+
+// GPIO recorder. Every level change of a pin goes to the trace file (SIM_TRACE) as
+// "<ns> <pin> <level>", with the pin named after pins.h where it has a name there.
+struct pin_name_t {
+    PinName pin;
+    const char *name;
+};
+
+static const pin_name_t pin_names[] = {
+    {X_STEP_PIN, "X_STEP"}, {X_DIR_PIN, "X_DIR"}, {X_ENABLE_PIN, "X_ENABLE"},
+    {Y_STEP_PIN, "Y_STEP"}, {Y_DIR_PIN, "Y_DIR"}, {Y_ENABLE_PIN, "Y_ENABLE"},
+    {Z_STEP_PIN, "Z_STEP"}, {Z_DIR_PIN, "Z_DIR"}, {Z_ENABLE_PIN, "Z_ENABLE"},
+    {E_STEP_PIN, "E_STEP"}, {E_DIR_PIN, "E_DIR"}, {E_ENABLE_PIN, "E_ENABLE"},
+    {HEATER_0_PIN, "HEATER_0"}, {HEATER_1_PIN, "HEATER_1"}, {FAN_PIN, "FAN"},
+    {LED1, "LED1"}, {LED2, "LED2"}, {LED3, "LED3"}, {LED4, "LED4"}
+};
+
+static int pin_level[SIM_PINS];
+static unsigned long pin_rising_edges[SIM_PINS];
+static unsigned long gpio_writes = 0;
+static FILE *trace = 0;
+
+static const char *pin_name(int pin) {
+    static char name[16];
+    for (unsigned int i = 0; i < sizeof(pin_names)/sizeof(pin_names[0]); i++) {
+        if (sim_pin_index(pin_names[i].pin) == pin) return pin_names[i].name;
+    }
+    sprintf(name, "P%d.%d", pin/32, pin%32);
+    return name;
+}
+
+static void set_pin(int pin, int level) {
+    level = level ? 1 : 0;
+    if (level == pin_level[pin]) return;
+    if (level) pin_rising_edges[pin]++;
+    pin_level[pin] = level;
+    if (trace) fprintf(trace, "%llu %s %d\n", sim_ns, pin_name(pin), level);
+}
+
+sim_port_write_t sim_write_log[SIM_WRITE_LOG_SIZE];
+int sim_write_log_count = 0;
+
+// Step pin writes of the stepper interrupt. An edge of the step pulses is one FIOSET or FIOCLR for
+// each port with the step pins of all axes that step, see set_step_pins() in main.cpp. So a write
+// doesn't mix step pins with other pins, and one interrupt writes the step pins of a port at most
+// once per level (the fall of a pulse and the rise of the next one can share an interrupt).
+// Anything else stops the simulator.
+static const PinName step_pins[] = {X_STEP_PIN, Y_STEP_PIN, Z_STEP_PIN, E_STEP_PIN};
+static int in_tim2 = 0;
+static unsigned long tim2_calls = 0, tim2_writes = 0, tim2_writes_max = 0, tim2_step_writes = 0;
+static uint32_t tim2_step_ports[2]; // bit n: the step pins of port n were written at level 0 / 1 in this interrupt
+
+static uint32_t step_pin_mask(int port) {
+    uint32_t mask = 0;
+    for (unsigned int i = 0; i < sizeof(step_pins)/sizeof(step_pins[0]); i++) {
+        if (step_pins[i] != NC && sim_pin_index(step_pins[i])/32 == port) mask |= 1UL << (sim_pin_index(step_pins[i]) % 32);
+    }
+    return mask;
+}
+
+static void check_step_write(int port, uint32_t mask, int level) {
+    uint32_t step_mask = step_pin_mask(port);
+    if (!(mask & step_mask)) return;
+    tim2_step_writes++;
+    if ((mask & ~step_mask) || (tim2_step_ports[level] & (1UL << port))) {
+        fprintf(stderr, "%llu ns: stepper interrupt wrote %s %08lx to port %d, %s\n", sim_ns, level ? "FIOSET" : "FIOCLR",
+            (unsigned long)mask, port, (mask & ~step_mask) ? "step pins mixed with other pins" : "second write of its step pins");
+        exit(2);
+    }
+    tim2_step_ports[level] |= 1UL << port;
+}
+
+// FIOSET/FIOCLR, one write sets or clears all pins of the mask at the same time
+void sim_port_write(int port, uint32_t mask, int level) {
+    gpio_writes++;
+    if (sim_write_log_count < SIM_WRITE_LOG_SIZE) {
+        sim_port_write_t *entry = &sim_write_log[sim_write_log_count];
+        entry->port = port;
+        entry->mask = mask;
+        entry->level = level;
+    }
+    sim_write_log_count++;
+    if (in_tim2) {
+        tim2_writes++;
+        check_step_write(port, mask, level);
+    }
+    for (int bit = 0; bit < 32; bit++) {
+        if (mask & (1UL << bit)) set_pin(port*32 + bit, level);
+    }
+}
+
+// DigitalOut
+void sim_pin_write(int pin, int level) {
+    gpio_writes++;
+    set_pin(pin, level);
+}
+
+
+// Timer 2, the step timer. It counts at CCLK/(PR + 1), main.cpp uses MCR bits 0 and 1 (interrupt and reset
+// on MR0) and bit 3 (interrupt on MR1). MR1 matches once per run of TC from zero, and only if it comes before MR0.
+#define SIM_CCLK_MHZ 96
+
+static unsigned long long tim2_start_ns = 0;
+static unsigned long long tim2_mr1_ns = 0; // time of the last MR1 match
+static void (*tim2_handler)() = 0;
+
+static unsigned long long tim2_ticks_to_ns(unsigned long long ticks) {
+    return ticks*1000*(sim_tim2.PR + 1)/SIM_CCLK_MHZ;
+}
+
+SimTimerCount::operator uint32_t() const {
+    if (this == &sim_tim3.TC) return (uint32_t)(sim_ns/1000 + sim_timer_offset_us());
+    return (uint32_t)((sim_ns - tim2_start_ns)*SIM_CCLK_MHZ/(1000*(sim_tim2.PR + 1)));
+}
+
+SimTimerControl &SimTimerControl::operator=(uint32_t control) {
+    if ((control & 2) || ((control & 1) && !(value & 1))) tim2_start_ns = sim_ns; // reset, or started
+    value = control;
+    return *this;
+}
+
+// The handlers are in the same executable, the upper half of the address is that of any function in it
+void NVIC_SetVector(IRQn_Type irq, uint32_t vector) {
+    if (irq == TIMER2_IRQn) {
+        tim2_handler = (void (*)())(((uintptr_t)&sim_poll & ~(uintptr_t)0xFFFFFFFFUL) | vector);
+    }
+}
+
+static void run_tim2() {
+    while ((sim_tim2.TCR.value & 1) && tim2_handler) {
+        unsigned long long due = tim2_start_ns + tim2_ticks_to_ns(sim_tim2.MR0);
+        unsigned long long due_mr1 = ~0ULL;
+        if ((sim_tim2.MCR & 8) && sim_tim2.MR1 <= sim_tim2.MR0) {
+            due_mr1 = tim2_start_ns + tim2_ticks_to_ns(sim_tim2.MR1);
+            if (due_mr1 <= tim2_mr1_ns) due_mr1 = ~0ULL; // this one has matched already
+        }
+        if (sim_ns < due && sim_ns < due_mr1) break;
+        if (due_mr1 <= due) {
+            sim_tim2.IR.value |= 2;
+            tim2_mr1_ns = due_mr1;
+        }
+        if (due <= due_mr1) {
+            sim_tim2.IR.value |= 1;
+            tim2_start_ns = due;
+        }
+        sim_ns += SIM_ISR_ENTRY_NS;
+        in_isr = in_tim2 = 1;
+        tim2_calls++;
+        tim2_writes = 0;
+        tim2_step_ports[0] = tim2_step_ports[1] = 0;
+        tim2_handler();
+        in_isr = in_tim2 = 0;
+        if (tim2_writes > tim2_writes_max) tim2_writes_max = tim2_writes;
+    }
+}
+
+
+// Ticker
+static void (*ticker_handler)() = 0;
+static unsigned long long ticker_period_ns = 0;
+static unsigned long long ticker_next_ns = 0;
+
+void sim_ticker_attach(void (*handler)(), unsigned long us) {
+    ticker_handler = handler;
+    ticker_period_ns = us*1000ULL;
+    ticker_next_ns = sim_ns + ticker_period_ns;
+}
+
+static void run_ticker() {
+    while (ticker_handler && sim_ns >= ticker_next_ns) {
+        ticker_next_ns += ticker_period_ns;
+        in_isr = 1;
+        ticker_handler();
+        in_isr = 0;
+    }
+}
+
+// SIM_CLOCK_OFFSET starts Timer at that many microseconds, e.g. 4294000000 to run into the wrap of read_us()
+unsigned long sim_timer_offset_us() {
+    static unsigned long offset = strtoul(env("SIM_CLOCK_OFFSET", "0"), 0, 10);
+    return offset;
+}
+
+
+// The host. It sends the G-code of stdin (or the file SIM_INPUT) one byte per character time and counts
+// the "ok" replies: at most SIM_WINDOW messages (default 1, like ReplicatorG) are waiting for theirs.
+// A message is an ASCII line or a BinaryProtocol.h packet.
+static FILE *input = 0;
+static void (*rx_handler)() = 0;
+static int rx_pending = -1;
+static int rx_window = 1;
+static unsigned long long byte_ns = 10000000000ULL/57600; // start bit, 8 data bits, stop bit
+static unsigned long long next_byte_ns = 0;
+static unsigned long long input_end_ns = 0;
+static bool input_ended = false;
+static unsigned long messages_sent = 0;
+static unsigned long oks_received = 0;
+
+static char message[256];
+static int message_length = 0;
+static bool message_binary = false;
+
+void sim_serial_attach(void (*handler)()) {
+    rx_handler = handler;
+}
+
+void sim_serial_baud(int baud) {
+    byte_ns = 10000000000ULL/baud;
+}
+
+int sim_serial_readable() {
+    return rx_pending >= 0;
+}
+
+int sim_serial_getc() {
+    int c = rx_pending;
+    rx_pending = -1;
+    return c;
+}
+
+// Replies don't take any time, the firmware can't be slowed down by the host in the simulator
+void sim_serial_output(const char *data, int length) {
+    static char previous = 0;
+    fwrite(data, 1, length, stdout);
+    for (int i = 0; i < length; i++) {
+        if (previous == 'o' && data[i] == 'k') {
+            oks_received++;
+            if (trace) fprintf(trace, "%llu ok\n", sim_ns);
+        }
+        previous = data[i];
+    }
+}
+
+// True once c completes a message
+static bool message_end(int c) {
+    if (!message_length) message_binary = (c == 0xA5); // BINARY_SYNC
+    if (message_length < (int)sizeof(message) - 1) message[message_length++] = c;
+    if (!message_binary) return c == '\n';
+    if (message_length < 10) return false;
+    unsigned long mask = ((unsigned char)message[6] | ((unsigned char)message[7] << 8) | ((unsigned char)message[8] << 16)
+        | ((unsigned long)(unsigned char)message[9] << 24)) & 0x3FFFFFF;
+    int fields = 0;
+    for (; mask; mask &= mask - 1) fields++;
+    return message_length >= 10 + 4*fields + 2;
+}
+
+static void run_host() {
+    if (!rx_handler || input_ended || sim_ns < next_byte_ns) return;
+    if (!message_length && (long)(messages_sent - oks_received) >= rx_window) return;
+
+    int c = fgetc(input);
+    if (c == EOF) {
+        input_ended = true;
+        input_end_ns = sim_ns;
+        return;
+    }
+    if (message_end(c)) {
+        if (trace) {
+            if (message_binary) fprintf(trace, "%llu rx binary %d bytes\n", sim_ns, message_length);
+            else fprintf(trace, "%llu rx %.*s", sim_ns, message_length, message);
+        }
+        message_length = 0;
+        messages_sent++;
+    }
+    next_byte_ns = sim_ns + byte_ns;
+    rx_pending = c;
+    in_isr = 1;
+    rx_handler();
+    in_isr = 0;
+}
+
+
+// Thermal model of a heater block with its thermistor: the heater heats the block, the block loses heat
+// to the room, and the thermistor follows the block with a delay. The thermistor is the one of ThermistorTable.h.
+struct thermal_model_t {
+    PinName heater_pin;
+    PinName sensor_pin;
+    double heater_watts;
+    double joules_per_kelvin;
+    double loss_watts_per_kelvin;
+    double sensor_lag_seconds;
+    double block_temperature;
+    double sensor_temperature;
+};
+
+#define SIM_ROOM_TEMPERATURE 25.0
+
+static thermal_model_t thermal_models[] = {
+    {HEATER_0_PIN, TEMP_0_PIN, 40.0, 8.0, 0.2, 3.0, SIM_ROOM_TEMPERATURE, SIM_ROOM_TEMPERATURE}, // hot end
+    {HEATER_1_PIN, TEMP_1_PIN, 120.0, 400.0, 1.2, 10.0, SIM_ROOM_TEMPERATURE, SIM_ROOM_TEMPERATURE} // heated bed
+};
+static unsigned long long thermal_ns = 0;
+
+static unsigned short thermistor_raw(double temperature) {
+    double r = 100000.0*exp(4036.0*(1.0/(temperature + 273.15) - 1.0/(25.0 + 273.15)));
+    return (unsigned short)(65535*r/(r + 4700.0));
+}
+
+static void run_thermal_models() {
+    double dt = (sim_ns - thermal_ns)/1e9;
+    if (dt < 0.001) return;
+    thermal_ns = sim_ns;
+
+    for (unsigned int i = 0; i < sizeof(thermal_models)/sizeof(thermal_models[0]); i++) {
+        thermal_model_t &model = thermal_models[i];
+        if (model.sensor_pin == NC) continue;
+        bool heating = model.heater_pin != NC && pin_level[sim_pin_index(model.heater_pin)];
+        double watts = (heating ? model.heater_watts : 0) - (model.block_temperature - SIM_ROOM_TEMPERATURE)*model.loss_watts_per_kelvin;
+        model.block_temperature += dt*watts/model.joules_per_kelvin;
+        model.sensor_temperature += (model.block_temperature - model.sensor_temperature)*dt/model.sensor_lag_seconds;
+        sim_adc[sim_pin_index(model.sensor_pin)] = thermistor_raw(model.sensor_temperature);
+    }
+}
+
+
+static void report() {
+    fprintf(stderr, "time %.3f s, steps X%lu Y%lu Z%lu E%lu, %lu GPIO writes, %lu messages\n", sim_ns/1e9,
+        pin_rising_edges[sim_pin_index(X_STEP_PIN)], pin_rising_edges[sim_pin_index(Y_STEP_PIN)],
+        pin_rising_edges[sim_pin_index(Z_STEP_PIN)], pin_rising_edges[sim_pin_index(E_STEP_PIN)],
+        gpio_writes, messages_sent);
+    fprintf(stderr, "stepper interrupt: %lu calls, %lu step pin writes, at most %lu GPIO writes in one call\n",
+        tim2_calls, tim2_step_writes, tim2_writes_max);
+}
+
+// Runs whatever is due at sim_ns. Interrupts are taken in between two accesses of the firmware to the
+// simulated hardware, not in the middle of a calculation, and never inside another interrupt.
+void sim_poll() {
+    static unsigned long long tail_ns = strtoull(env("SIM_TAIL", "5"), 0, 10)*1000000000ULL;
+    if (input_ended && sim_ns > input_end_ns + tail_ns) {
+        report();
+        if (trace) fclose(trace);
+        exit(0);
+    }
+
+    run_thermal_models();
+    if (in_isr || sim_irq_disabled) return;
+    run_tim2();
+    run_ticker();
+    run_host();
+}
+
+// Runs before main(), the global constructors of main.cpp don't use the simulator
+struct sim_init_t {
+    sim_init_t() {
+        input = stdin;
+        const char *name = getenv("SIM_INPUT");
+        if (name && !(input = fopen(name, "rb"))) {
+            fprintf(stderr, "can't open %s\n", name);
+            exit(1);
+        }
+        name = getenv("SIM_TRACE");
+        if (name && !(trace = fopen(name, "w"))) {
+            fprintf(stderr, "can't open %s\n", name);
+            exit(1);
+        }
+        rx_window = atoi(env("SIM_WINDOW", "1"));
+        if (rx_window < 1) rx_window = 1;
+        for (int i = 0; i < SIM_PINS; i++) sim_adc[i] = thermistor_raw(SIM_ROOM_TEMPERATURE);
+    }
+} sim_init;
+
+#endif
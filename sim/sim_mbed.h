@@ -0,0 +1,255 @@
+#ifndef SIM_MBED_H_
+#define SIM_MBED_H_
+
+// The part of the mbed library main.cpp uses, for running the firmware on a PC (see sim/README).
+// Nothing happens in real time: every peripheral access moves a virtual clock forward and sim_poll()
+// runs the interrupts that have become due at that point, so the firmware behaves the same on every run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include <dirent.h>
+
+// The mbed library numbers the pins from P0_0 = LPC_GPIO0_BASE up, 32 per port, like the LPC1768 target does
+#define LPC_GPIO0_BASE 0x2009C000UL
+#define SIM_PIN(port, bit) (LPC_GPIO0_BASE + (port)*32 + (bit))
+#define SIM_PIN_INDEX(pin) ((int)((unsigned long)(pin) - LPC_GPIO0_BASE)) // 0 .. SIM_PINS-1
+#define SIM_PINS 160
+
+typedef enum {
+    p5 = SIM_PIN(0, 9), p6 = SIM_PIN(0, 8), p7 = SIM_PIN(0, 7), p8 = SIM_PIN(0, 6),
+    p9 = SIM_PIN(0, 0), p10 = SIM_PIN(0, 1), p11 = SIM_PIN(0, 18), p12 = SIM_PIN(0, 17),
+    p13 = SIM_PIN(0, 15), p14 = SIM_PIN(0, 16), p15 = SIM_PIN(0, 23), p16 = SIM_PIN(0, 24),
+    p17 = SIM_PIN(0, 25), p18 = SIM_PIN(0, 26), p19 = SIM_PIN(1, 30), p20 = SIM_PIN(1, 31),
+    p21 = SIM_PIN(2, 5), p22 = SIM_PIN(2, 4), p23 = SIM_PIN(2, 3), p24 = SIM_PIN(2, 2),
+    p25 = SIM_PIN(2, 1), p26 = SIM_PIN(2, 0), p27 = SIM_PIN(0, 11), p28 = SIM_PIN(0, 10),
+    p29 = SIM_PIN(0, 5), p30 = SIM_PIN(0, 4),
+    LED1 = SIM_PIN(1, 18), LED2 = SIM_PIN(1, 20), LED3 = SIM_PIN(1, 21), LED4 = SIM_PIN(1, 23),
+    USBTX = SIM_PIN(0, 2), USBRX = SIM_PIN(0, 3),
+    NC = -1
+} PinName;
+
+// Virtual time in nanoseconds, and what the simulated accesses cost of it
+extern unsigned long long sim_ns;
+#define SIM_TIMER_READ_NS 2000 // Timer::read_us()
+#define SIM_ADC_READ_NS 20000 // one conversion of AnalogIn::read_u16()
+#define SIM_ISR_ENTRY_NS 1000 // from the match of timer 2 to the first line of the handler
+
+void sim_poll();
+void sim_pin_write(int pin, int level); // one GPIO write of a single pin
+void sim_serial_output(const char *data, int length);
+void sim_serial_attach(void (*handler)());
+void sim_serial_baud(int baud);
+int sim_serial_readable();
+int sim_serial_getc();
+void sim_ticker_attach(void (*handler)(), unsigned long us);
+unsigned long sim_timer_offset_us();
+extern unsigned short sim_adc[SIM_PINS];
+
+inline void sim_advance_ns(unsigned long long ns) {
+    sim_ns += ns;
+    sim_poll();
+}
+
+inline int sim_pin_index(PinName pin) {
+    return pin == NC ? -1 : SIM_PIN_INDEX(pin);
+}
+
+class DigitalOut {
+public:
+    DigitalOut(PinName pin) : pin_(sim_pin_index(pin)), level_(0) {}
+    void write(int level) {
+        if (pin_ >= 0) sim_pin_write(pin_, level);
+        level_ = level;
+    }
+    int read() { return level_; }
+    DigitalOut &operator=(int level) { write(level); return *this; }
+    operator int() { return level_; }
+private:
+    int pin_;
+    int level_;
+};
+
+// No endstops are wired to the simulated printer, the inputs float high
+class DigitalIn {
+public:
+    DigitalIn(PinName) {}
+    int read() { return 1; }
+    operator int() { return 1; }
+};
+
+// Reads the value the thermal model of sim.cpp last put on the pin
+class AnalogIn {
+public:
+    AnalogIn(PinName pin) : pin_(sim_pin_index(pin)) {}
+    unsigned short read_u16() {
+        sim_advance_ns(SIM_ADC_READ_NS);
+        return pin_ >= 0 ? sim_adc[pin_] : 0xFFFF;
+    }
+    float read() { return read_u16()/65535.0f; }
+private:
+    int pin_;
+};
+
+// The host side of the link is sim.cpp, which sends the G-code at the speed of the baud rate
+class Serial {
+public:
+    enum IrqType { RxIrq, TxIrq };
+    Serial(PinName, PinName) {}
+    void baud(int baud) { sim_serial_baud(baud); }
+    int printf(const char *format, ...) {
+        char text[512];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        sim_serial_output(text, strlen(text));
+        return length;
+    }
+    int puts(const char *text) {
+        sim_serial_output(text, strlen(text));
+        return 0;
+    }
+    int putc(int c) {
+        char data = c;
+        sim_serial_output(&data, 1);
+        return c;
+    }
+    int getc() { return sim_serial_getc(); }
+    int readable() { return sim_serial_readable(); }
+    int writeable() { return 1; }
+    void attach(void (*handler)(), IrqType = RxIrq) { sim_serial_attach(handler); }
+};
+
+class Timer {
+public:
+    Timer() : start_ns_(0) {}
+    void start() { start_ns_ = sim_ns; }
+    void stop() {}
+    void reset() { start_ns_ = sim_ns; }
+    int read_us() {
+        sim_advance_ns(SIM_TIMER_READ_NS);
+        return (int)(unsigned long)((sim_ns - start_ns_)/1000 + sim_timer_offset_us());
+    }
+    int read_ms() { return read_us()/1000; }
+    float read() { return read_us()/1000000.0f; }
+private:
+    unsigned long long start_ns_;
+};
+
+// One Ticker at a time, main.cpp only has heater_ticker
+class Ticker {
+public:
+    void attach_us(void (*handler)(), unsigned long us) { sim_ticker_attach(handler, us); }
+    void attach(void (*handler)(), float seconds) { sim_ticker_attach(handler, (unsigned long)(seconds*1000000)); }
+    void detach() { sim_ticker_attach(0, 0); }
+};
+
+// The files of FILE_SYSTEM_ROOT are in the directory the simulator runs in
+class LocalFileSystem {
+public:
+    LocalFileSystem(const char *) {}
+};
+#define FILE_SYSTEM_ROOT "local"
+
+inline void wait_us(int us) { sim_advance_ns(us*1000ULL); }
+inline void wait_ms(int ms) { wait_us(ms*1000); }
+inline void wait(float seconds) { wait_us((int)(seconds*1000000)); }
+
+// Registers of the LPC1768 that main.cpp uses directly. The ones with side effects are
+// small classes, so an access to them reaches sim.cpp. Timer 3 counts microseconds, like the
+// mbed library sets it up for Timer and Ticker.
+class SimTimerCount {
+public:
+    operator uint32_t() const;
+};
+
+class SimTimerControl {
+public:
+    SimTimerControl &operator=(uint32_t value);
+    operator uint32_t() const { return value; }
+    uint32_t value;
+};
+
+// IR: a match sets its bit, writing a 1 clears the bit
+class SimTimerInterrupt {
+public:
+    SimTimerInterrupt &operator=(uint32_t bits) { value &= ~bits; return *this; }
+    operator uint32_t() const { return value; }
+    uint32_t value;
+};
+
+struct LPC_TIM_TypeDef {
+    SimTimerInterrupt IR;
+    SimTimerControl TCR;
+    SimTimerCount TC;
+    uint32_t PR, PC, MCR, MR0, MR1, MR2, MR3, CCR, CR0, CR1, EMR, CTCR;
+};
+
+struct LPC_SC_TypeDef {
+    uint32_t PCONP, PCLKSEL0, PCLKSEL1;
+};
+
+void sim_port_write(int port, uint32_t mask, int level);
+
+// The FIOSET/FIOCLR writes since sim_write_log_count was set to 0, the first SIM_WRITE_LOG_SIZE of
+// them are kept. check.cpp looks at the writes of single calls into main.cpp with it.
+typedef struct {
+    int port;
+    uint32_t mask;
+    int level;
+} sim_port_write_t;
+
+#define SIM_WRITE_LOG_SIZE 16
+extern sim_port_write_t sim_write_log[SIM_WRITE_LOG_SIZE];
+extern int sim_write_log_count;
+
+class SimPortSet {
+public:
+    SimPortSet &operator=(uint32_t mask) { sim_port_write(port, mask, 1); return *this; }
+    int port;
+};
+
+class SimPortClear {
+public:
+    SimPortClear &operator=(uint32_t mask) { sim_port_write(port, mask, 0); return *this; }
+    int port;
+};
+
+struct LPC_GPIO_TypeDef {
+    uint32_t FIODIR, FIOMASK, FIOPIN;
+    SimPortSet FIOSET;
+    SimPortClear FIOCLR;
+};
+
+extern LPC_GPIO_TypeDef sim_gpio[5];
+extern LPC_TIM_TypeDef sim_tim2, sim_tim3;
+extern LPC_SC_TypeDef sim_sc;
+#define LPC_GPIO0 (&sim_gpio[0])
+#define LPC_GPIO1 (&sim_gpio[1])
+#define LPC_GPIO2 (&sim_gpio[2])
+#define LPC_GPIO3 (&sim_gpio[3])
+#define LPC_GPIO4 (&sim_gpio[4])
+#define LPC_TIM2 (&sim_tim2)
+#define LPC_TIM3 (&sim_tim3)
+#define LPC_SC (&sim_sc)
+
+// Interrupts don't nest in the simulator, the priorities only matter on the mbed
+typedef enum { TIMER0_IRQn = 1, TIMER1_IRQn, TIMER2_IRQn, TIMER3_IRQn, UART0_IRQn } IRQn_Type;
+void NVIC_SetVector(IRQn_Type irq, uint32_t vector);
+inline void NVIC_SetPriority(IRQn_Type, uint32_t) {}
+inline void NVIC_EnableIRQ(IRQn_Type) {}
+inline void NVIC_DisableIRQ(IRQn_Type) {}
+
+extern int sim_irq_disabled;
+inline void __disable_irq() { sim_irq_disabled = 1; }
+inline void __enable_irq() { sim_irq_disabled = 0; sim_poll(); }
+
+// Nothing can come in between the two, the exclusive store always succeeds
+inline unsigned long __ldrex(volatile unsigned long *address) { return *address; }
+inline int __strex(unsigned long value, volatile unsigned long *address) { *address = value; return 0; }
+
+#endif
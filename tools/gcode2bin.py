@@ -0,0 +1,156 @@
+#!/usr/bin/env python
+# Convert G-code to the binary packets of BinaryProtocol.h and optionally stream them to the printer.
+#
+#   gcode2bin.py print.gcode                      print bytes per line, ASCII vs binary
+#   gcode2bin.py print.gcode -o print.bin         also write the byte stream the host would send
+#   gcode2bin.py print.gcode --port /dev/ttyACM0  stream it (needs pyserial) and measure lines/s
+#
+# The stream starts with an ASCII "M860" line. Lines that can't be packed (words without a number)
+# are sent as ASCII in between a binary "M860 S0" packet and a new ASCII "M860".
+
+import argparse
+import re
+import struct
+import sys
+import time
+
+SYNC = 0xA5
+WORD = re.compile(r'([A-Z])([-+]?[0-9]*\.?[0-9]*)')
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in bytearray(data):
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def encode(sequence, letter, number, fields):
+    """fields maps letters to values, letter/number is the command word, e.g. 'G', 1"""
+    mask = 0
+    for key in fields:
+        mask |= 1 << (ord(key) - ord('A'))
+    body = struct.pack('<HBHI', sequence & 0xFFFF, ord(letter) if letter else 0, number, mask)
+    for key in sorted(fields):
+        body += struct.pack('<f', fields[key])
+    return bytearray([SYNC]) + body + struct.pack('<H', crc16(body))
+
+
+def words(line):
+    """Split a line into (letter, value) pairs, None if it holds anything else"""
+    line = line.split(';')[0].strip().upper()
+    if not line:
+        return []
+    result = []
+    pos = 0
+    for match in WORD.finditer(line):
+        if line[pos:match.start()].strip() or not match.group(2):
+            return None
+        result.append((match.group(1), float(match.group(2))))
+        pos = match.end()
+    if line[pos:].strip():
+        return None
+    return result
+
+
+def ascii_line(line_number, text):
+    line = 'N%d %s' % (line_number, text)
+    checksum = 0
+    for c in line:
+        checksum ^= ord(c)
+    return ('%s*%d\n' % (line, checksum)).encode('ascii')
+
+
+def convert(lines):
+    """Yield the ASCII line and the list of messages that replace it, each one answered by an ok"""
+    line_number = 0
+    binary = False
+    for text in lines:
+        text = text.split(';')[0].strip()
+        if not text:
+            continue
+        pairs = words(text)
+        line_number += 1
+        ascii_bytes = ascii_line(line_number, text)
+
+        messages = []
+        if pairs is None:
+            if binary:
+                messages.append(encode(line_number, 'M', 860, {'S': 0.0}))
+                line_number += 1
+                binary = False
+            messages.append(ascii_line(line_number, text))
+            yield ascii_bytes, messages
+            continue
+
+        if not binary:
+            messages.append(ascii_line(line_number, 'M860'))
+            line_number += 1
+            binary = True
+        letter, number, fields = None, 0, {}
+        for key, value in pairs:
+            if key in fields or key == letter:
+                continue
+            if letter is None and key in 'GMT' and value == int(value) and 0 <= value < 65536:
+                letter, number = key, int(value)
+            elif key != 'N':
+                fields[key] = value
+        messages.append(encode(line_number, letter, number, fields))
+        yield ascii_bytes, messages
+
+
+def stream(port, baud, messages):
+    import serial
+    link = serial.Serial(port, baud, timeout=10)
+    while b'start' not in link.readline():
+        pass
+    start = time.time()
+    for message in messages:
+        link.write(message)
+        while True:
+            reply = link.readline()
+            if not reply:
+                sys.exit('no reply from the printer')
+            if reply.startswith(b'ok'):
+                break
+            if reply.startswith(b'Resend'):
+                link.readline()  # its ok
+                link.write(message)
+    return time.time() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('gcode')
+    parser.add_argument('-o', '--output', help='write the binary stream to this file')
+    parser.add_argument('--port', help='serial port of the printer')
+    parser.add_argument('--baud', type=int, default=57600)
+    args = parser.parse_args()
+
+    with open(args.gcode) as f:
+        pairs = list(convert(f))
+    ascii_total = sum(len(a) for a, b in pairs)
+    binary_total = sum(len(m) for a, b in pairs for m in b)
+    count = max(len(pairs), 1)
+    byte_time = 10.0 / args.baud  # start + 8 data + stop bit
+
+    print('lines: %d' % len(pairs))
+    print('ascii:  %d bytes, %.1f bytes/line, at most %.0f lines/s' % (ascii_total, float(ascii_total) / count, count / (ascii_total * byte_time or 1)))
+    print('binary: %d bytes, %.1f bytes/line, at most %.0f lines/s' % (binary_total, float(binary_total) / count, count / (binary_total * byte_time or 1)))
+
+    if args.output:
+        with open(args.output, 'wb') as f:
+            for a, b in pairs:
+                for message in b:
+                    f.write(message)
+
+    if args.port:
+        seconds = stream(args.port, args.baud, [m for a, b in pairs for m in b])
+        print('streamed in %.2f s, %.0f lines/s' % (seconds, len(pairs) / seconds))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,150 @@
+#!/usr/bin/env python
+# Turn an event trace dump (M871, see EventTrace.h) into Chrome trace JSON, for chrome://tracing or ui.perfetto.dev.
+#
+#   trace2chrome.py dump.bin -o trace.json                    a captured dump, anything around it is skipped
+#   trace2chrome.py --port /dev/ttyACM0 -o trace.json         send M871 and read the dump (needs pyserial)
+#   trace2chrome.py --port /dev/ttyACM0 --start [--mask N]    send M870 to clear the trace and start recording
+#
+# Event types are the bit numbers of the mask: 0 line received, 1 ok sent, 2 move start, 3 move end,
+# 4 step interrupt, 5 heater on/off, 6 ADC sample. The step interrupts fill the buffer fastest,
+# e.g. --mask 111 records everything else.
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+from gcode2bin import crc16
+
+HEADER = re.compile(br'trace:(\d+) lost:(\d+) us:(\d+)\n')
+EVENT = struct.Struct('<IBBH')
+
+LINE_RECEIVED, OK_SENT, MOVE_START, MOVE_END, STEP_ISR, HEATER, ADC = range(7)
+STEP_TIMER_TICKS_PER_US = 24
+
+
+def parse(data):
+    """Return the events of the first dump in data as (us, type, arg, data), with the timer wraps removed"""
+    match = HEADER.search(data)
+    if not match:
+        sys.exit('no trace in the input')
+    count, lost = int(match.group(1)), int(match.group(2))
+    start = match.end()
+    body = data[start:start + count * EVENT.size]
+    if len(body) < count * EVENT.size or len(data) < start + len(body) + 2:
+        sys.exit('the trace is cut off')
+    if struct.unpack('<H', data[start + len(body):start + len(body) + 2])[0] != crc16(body):
+        sys.exit('CRC error in the trace')
+    if lost:
+        sys.stderr.write('%d older events were overwritten\n' % lost)
+
+    events = []
+    high = 0
+    last = None
+    for i in range(count):
+        time, kind, arg, value = EVENT.unpack_from(body, i * EVENT.size)
+        # Interrupts may record out of order by a few us, only a big step back is a wrap of the 32 bit clock
+        if last is not None and time < last and last - time > 1 << 31:
+            high += 1 << 32
+        last = time
+        events.append((high + time, kind, arg, value))
+    events.sort(key=lambda event: event[0])
+    return events
+
+
+def chrome_trace(events):
+    threads = {'serial': 1, 'moves': 2, 'stepper': 3, 'heater 0': 4, 'heater 1': 5}
+    out = []
+    for name, tid in threads.items():
+        out.append({'ph': 'M', 'name': 'thread_name', 'pid': 1, 'tid': tid, 'args': {'name': name}})
+
+    def add(ph, name, thread, us, **args):
+        event = {'ph': ph, 'name': name, 'pid': 1, 'tid': threads[thread], 'ts': us}
+        if ph == 'i':
+            event['s'] = 't'
+        if args:
+            event['args'] = args
+        out.append(event)
+
+    open_moves = set()
+    heater_on = [False, False]
+    for us, kind, arg, value in events:
+        if kind == LINE_RECEIVED:
+            add('i', 'file line %d' % value if arg else 'line %d' % value, 'serial', us)
+        elif kind == OK_SENT:
+            add('i', 'ok', 'serial', us)
+        elif kind == MOVE_START:
+            add('B', 'block %d' % arg, 'moves', us, step_events=value)
+            open_moves.add(arg)
+        elif kind == MOVE_END:
+            if arg in open_moves:  # the start may have been overwritten
+                add('E', 'block %d' % arg, 'moves', us)
+                open_moves.discard(arg)
+        elif kind == STEP_ISR:
+            add('i', 'step', 'stepper', us, late_us=float(value) / STEP_TIMER_TICKS_PER_US)
+        elif kind == HEATER and arg < 2:
+            thread = 'heater %d' % arg
+            if value and not heater_on[arg]:
+                add('B', 'on', thread, us)
+            elif not value and heater_on[arg]:
+                add('E', 'on', thread, us)
+            heater_on[arg] = bool(value)
+        elif kind == ADC:
+            out.append({'ph': 'C', 'name': 'ADC %d' % arg, 'pid': 1, 'ts': us, 'args': {'raw': value}})
+    return {'traceEvents': out, 'displayTimeUnit': 'ms'}
+
+
+def read_from_printer(port, baud, command):
+    import serial
+    link = serial.Serial(port, baud, timeout=5)
+    link.write(command.encode('ascii') + b'\n')
+    data = b''
+    while True:
+        chunk = link.read(4096)
+        if not chunk:
+            return data
+        data += chunk
+        match = HEADER.search(data)
+        if match and len(data) >= match.end() + int(match.group(1)) * EVENT.size + 2:
+            return data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('dump', nargs='?', help='file with the output of M871')
+    parser.add_argument('-o', '--output', help='write the Chrome trace here instead of stdout')
+    parser.add_argument('--port', help='serial port of the printer')
+    parser.add_argument('--baud', type=int, default=57600)
+    parser.add_argument('--start', action='store_true', help='start recording instead of reading the trace')
+    parser.add_argument('--mask', type=int, help='event types to record with --start, default all')
+    args = parser.parse_args()
+
+    if args.start:
+        if not args.port:
+            sys.exit('--start needs --port')
+        import serial
+        command = 'M870' if args.mask is None else 'M870 S%d' % args.mask
+        serial.Serial(args.port, args.baud, timeout=5).write(command.encode('ascii') + b'\n')
+        return
+
+    if args.port:
+        data = read_from_printer(args.port, args.baud, 'M871')
+    elif args.dump:
+        with open(args.dump, 'rb') as f:
+            data = f.read()
+    else:
+        parser.error('give a dump file or --port')
+
+    events = parse(data)
+    trace = json.dumps(chrome_trace(events))
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(trace)
+    else:
+        print(trace)
+    sys.stderr.write('%d events\n' % len(events))
+
+
+if __name__ == '__main__':
+    main()